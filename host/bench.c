@@ -0,0 +1,530 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gctypes.h>
+
+/*
+    A load generator for ftpii: runs each scenario with a number of concurrent sessions, each on its own thread,
+    and prints one fact line of results per scenario to stdout, so that runs against different builds can be diffed.
+    Expects the fixture that bench.sh creates under /carda/bench.
+*/
+
+#define REPLY_BUFFER_SIZE 4096
+#define DATA_BUFFER_SIZE 65536
+#define SMALL_FILES 256
+#define SMALL_FILE_SIZE 4096
+#define PIPELINE_DEPTH 16
+#define LARGE_CLIENTS 2
+
+typedef struct {
+    u64 *samples; // nanoseconds
+    u32 count;
+    u32 capacity;
+} latencies_t;
+
+typedef struct client_struct client_t;
+
+typedef struct {
+    const char *name;
+    u32 iterations; // per client, before scaling
+    bool large; // run by at most LARGE_CLIENTS clients, once each
+    bool serial; // run by one client, so that its latencies are a transfer's own round trips, free of contention
+    bool own_latencies; // run records a sample per command rather than one per iteration
+    s32 (*run)(client_t *client, u32 iteration);
+} scenario_t;
+
+struct client_struct {
+    u32 index;
+    int control;
+    char buf[REPLY_BUFFER_SIZE];
+    u32 start;
+    u32 end;
+    const scenario_t *scenario;
+    u32 iterations;
+    u64 bytes;
+    u32 ops;
+    u32 errors;
+    u64 start_time;
+    u64 end_time;
+    latencies_t latencies;
+};
+
+static struct sockaddr_in server_address;
+static const char *password = "";
+static u32 num_clients = 8;
+static u32 scale = 1;
+static u64 large_size = 64 * 1024 * 1024;
+static u32 running_clients = 0;
+static bool announce_sizes = false; // send ALLO before each STOR
+static pthread_barrier_t barrier;
+
+static u64 now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void record_latency(latencies_t *latencies, u64 ns) {
+    if (latencies->count == latencies->capacity) {
+        u32 capacity = latencies->capacity ? latencies->capacity * 2 : 256;
+        u64 *samples = realloc(latencies->samples, capacity * sizeof(u64));
+        if (!samples) return;
+        latencies->samples = samples;
+        latencies->capacity = capacity;
+    }
+    latencies->samples[latencies->count++] = ns;
+}
+
+static int connect_to(u16 port) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+    struct sockaddr_in address = server_address;
+    address.sin_port = htons(port);
+    if (connect(s, (struct sockaddr *)&address, sizeof(address))) {
+        close(s);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+static s32 send_all(int s, const char *data, u32 length) {
+    while (length) {
+        ssize_t sent = send(s, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) return -1;
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/*
+    Reads one line of the control connection into line, without its CRLF.
+*/
+static s32 read_line(client_t *client, char *line, u32 size) {
+    while (1) {
+        char *eol = memchr(client->buf + client->start, '\n', client->end - client->start);
+        if (eol) {
+            u32 length = eol - (client->buf + client->start);
+            if (length && eol[-1] == '\r') length--;
+            if (length >= size) length = size - 1;
+            memcpy(line, client->buf + client->start, length);
+            line[length] = '\0';
+            client->start = eol + 1 - client->buf;
+            return length;
+        }
+        if (client->start) {
+            memmove(client->buf, client->buf + client->start, client->end - client->start);
+            client->end -= client->start;
+            client->start = 0;
+        }
+        if (client->end == REPLY_BUFFER_SIZE) return -1;
+        ssize_t received = recv(client->control, client->buf + client->end, REPLY_BUFFER_SIZE - client->end, 0);
+        if (received <= 0) return -1;
+        client->end += received;
+    }
+}
+
+/*
+    Reads a complete, possibly multi-line, reply and returns its code, or -1 if the connection failed.
+    The text of the last line is left in text.
+*/
+static s32 read_reply(client_t *client, char *text, u32 size) {
+    char line[REPLY_BUFFER_SIZE];
+    if (read_line(client, line, sizeof(line)) < 4) return -1;
+    s32 code = atoi(line);
+    if (line[3] == '-') {
+        char terminator[5];
+        snprintf(terminator, sizeof(terminator), "%.3s ", line);
+        do {
+            if (read_line(client, line, sizeof(line)) < 0) return -1;
+        } while (strncmp(line, terminator, 4));
+    }
+    snprintf(text, size, "%s", line);
+    return code;
+}
+
+static s32 vsend_command(client_t *client, const char *format, va_list args) {
+    char line[REPLY_BUFFER_SIZE];
+    u32 length = vsnprintf(line, sizeof(line) - 2, format, args);
+    if (length > sizeof(line) - 3) return -1;
+    strcpy(line + length, "\r\n");
+    return send_all(client->control, line, length + 2);
+}
+
+static s32 send_command(client_t *client, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    s32 result = vsend_command(client, format, args);
+    va_end(args);
+    return result;
+}
+
+/*
+    Sends a command and returns the code of its reply, or -1 if the connection failed.
+*/
+static s32 command(client_t *client, char *text, u32 size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    s32 result = vsend_command(client, format, args);
+    va_end(args);
+    return result ? -1 : read_reply(client, text, size);
+}
+
+static int open_data_connection(client_t *client) {
+    char text[REPLY_BUFFER_SIZE];
+    if (command(client, text, sizeof(text), "EPSV") != 229) return -1;
+    char *ports = strstr(text, "(|||");
+    if (!ports) return -1;
+    return connect_to(atoi(ports + 4));
+}
+
+/*
+    Runs verb (RETR or LIST) on path and reads the data connection to the end.
+    Returns the number of bytes read, or -1.
+*/
+static s64 retrieve(client_t *client, const char *verb, const char *path) {
+    char text[REPLY_BUFFER_SIZE];
+    int data = open_data_connection(client);
+    if (data < 0) return -1;
+    s32 code = command(client, text, sizeof(text), "%s %s", verb, path);
+    if (code != 150 && code != 125) {
+        close(data);
+        return -1;
+    }
+    static __thread char buffer[DATA_BUFFER_SIZE];
+    s64 total = 0;
+    ssize_t received;
+    while ((received = recv(data, buffer, sizeof(buffer), 0)) > 0) total += received;
+    close(data);
+    if (received < 0 || read_reply(client, text, sizeof(text)) != 226) return -1;
+    return total;
+}
+
+static s64 store(client_t *client, const char *path, u64 size) {
+    char text[REPLY_BUFFER_SIZE];
+    int data = open_data_connection(client);
+    if (data < 0) return -1;
+    if (announce_sizes && command(client, text, sizeof(text), "ALLO %llu", size) != 200) {
+        close(data);
+        return -1;
+    }
+    s32 code = command(client, text, sizeof(text), "STOR %s", path);
+    if (code != 150 && code != 125) {
+        close(data);
+        return -1;
+    }
+    static __thread char buffer[DATA_BUFFER_SIZE];
+    memset(buffer, 'x' + client->index, sizeof(buffer));
+    u64 remaining = size;
+    s32 result = 0;
+    while (remaining && !result) {
+        u32 chunk = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+        result = send_all(data, buffer, chunk);
+        remaining -= chunk;
+    }
+    close(data);
+    if (result || read_reply(client, text, sizeof(text)) != 226) return -1;
+    return size;
+}
+
+static s32 count_bytes(client_t *client, s64 bytes) {
+    if (bytes < 0) return -1;
+    client->bytes += bytes;
+    return 0;
+}
+
+static s32 run_small_retr(client_t *client, u32 iteration) {
+    char path[64];
+    snprintf(path, sizeof(path), "/carda/bench/small/f%03u", (client->index * 37 + iteration) % SMALL_FILES);
+    return count_bytes(client, retrieve(client, "RETR", path));
+}
+
+static s32 run_small_stor(client_t *client, u32 iteration) {
+    char path[64];
+    snprintf(path, sizeof(path), "/carda/bench/upload/c%02u-%03u", client->index, iteration % SMALL_FILES);
+    return count_bytes(client, store(client, path, SMALL_FILE_SIZE));
+}
+
+static s32 run_large_retr(client_t *client, u32 iteration) {
+    return count_bytes(client, retrieve(client, "RETR", "/carda/bench/large.bin"));
+}
+
+static s32 run_large_stor(client_t *client, u32 iteration) {
+    char path[64];
+    snprintf(path, sizeof(path), "/carda/bench/upload/large-c%02u", client->index);
+    return count_bytes(client, store(client, path, large_size));
+}
+
+/*
+    Fetches this client's share of large.bin with REST and RETR, as a segmented downloader does,
+    closing the data connection as soon as the segment is in.
+*/
+static s32 run_segmented_retr(client_t *client, u32 iteration) {
+    char text[REPLY_BUFFER_SIZE];
+    u64 segment = (large_size + running_clients - 1) / running_clients;
+    u64 start = client->index * segment;
+    u64 wanted = start < large_size ? (large_size - start < segment ? large_size - start : segment) : 0;
+    int data = open_data_connection(client);
+    if (data < 0) return -1;
+    if (command(client, text, sizeof(text), "REST %llu", start) != 350) {
+        close(data);
+        return -1;
+    }
+    s32 code = command(client, text, sizeof(text), "RETR /carda/bench/large.bin");
+    if (code != 150 && code != 125) {
+        close(data);
+        return -1;
+    }
+    static __thread char buffer[DATA_BUFFER_SIZE];
+    u64 total = 0;
+    ssize_t received = 0;
+    while (total < wanted && (received = recv(data, buffer, sizeof(buffer), 0)) > 0) total += received;
+    close(data);
+    if (received < 0 || total < wanted || read_reply(client, text, sizeof(text)) < 0) return -1;
+    return count_bytes(client, wanted);
+}
+
+static s32 run_list(client_t *client, u32 iteration) {
+    s64 bytes = retrieve(client, "LIST", "/carda/bench/dir10k");
+    return count_bytes(client, bytes > 0 ? bytes : -1);
+}
+
+/*
+    Sends PIPELINE_DEPTH metadata commands in one go, then times each reply from when the batch was sent.
+*/
+static s32 run_metadata(client_t *client, u32 iteration) {
+    static const char *verbs[] = { "SIZE", "MDTM", "MLST", "NOOP", "PWD", "SYST", "FEAT", "TYPE" };
+    char batch[PIPELINE_DEPTH * 64];
+    u32 length = 0, i;
+    for (i = 0; i < PIPELINE_DEPTH; i++) {
+        u32 index = (client->index + iteration + i) % (sizeof(verbs) / sizeof(*verbs));
+        if (index < 3) {
+            length += sprintf(batch + length, "%s /carda/bench/small/f%03u\r\n", verbs[index], (iteration * PIPELINE_DEPTH + i) % SMALL_FILES);
+        } else if (index == 7) {
+            length += sprintf(batch + length, "TYPE I\r\n");
+        } else {
+            length += sprintf(batch + length, "%s\r\n", verbs[index]);
+        }
+    }
+    u64 sent = now();
+    if (send_all(client->control, batch, length)) return -1;
+    s32 result = 0;
+    for (i = 0; i < PIPELINE_DEPTH; i++) {
+        char text[REPLY_BUFFER_SIZE];
+        s32 code = read_reply(client, text, sizeof(text));
+        if (code < 0) return -1;
+        if (code >= 400) result = -1;
+        record_latency(&client->latencies, now() - sent);
+        client->ops++;
+    }
+    return result;
+}
+
+static const scenario_t scenarios[] = {
+    { "serial-retr", 50, false, true, false, run_small_retr },
+    { "serial-stor", 50, false, true, false, run_small_stor },
+    { "small-retr", 50, false, false, false, run_small_retr },
+    { "small-stor", 50, false, false, false, run_small_stor },
+    { "large-retr", 1, true, false, false, run_large_retr },
+    { "large-stor", 1, true, false, false, run_large_stor },
+    { "segmented-retr", 1, false, false, false, run_segmented_retr },
+    { "list", 3, false, false, false, run_list },
+    { "metadata", 20, false, false, true, run_metadata },
+};
+static const u32 NUM_SCENARIOS = sizeof(scenarios) / sizeof(*scenarios);
+
+static bool log_in(client_t *client) {
+    char text[REPLY_BUFFER_SIZE];
+    if ((client->control = connect_to(ntohs(server_address.sin_port))) < 0) return false;
+    if (read_reply(client, text, sizeof(text)) != 220) return false;
+    s32 code = command(client, text, sizeof(text), "USER bench");
+    if (code == 331) code = command(client, text, sizeof(text), "PASS %s", password);
+    if (code != 230) return false;
+    return command(client, text, sizeof(text), "TYPE I") == 200;
+}
+
+static void *client_thread(void *arg) {
+    client_t *client = arg;
+    bool ready = log_in(client);
+    if (!ready) fprintf(stderr, "Client %u could not log in.\n", client->index);
+    pthread_barrier_wait(&barrier);
+    client->start_time = now();
+    u32 i;
+    for (i = 0; ready && i < client->iterations; i++) {
+        u64 start = now();
+        if (client->scenario->run(client, i) < 0) {
+            client->errors++;
+            char text[REPLY_BUFFER_SIZE];
+            if (command(client, text, sizeof(text), "NOOP") != 200) break; // the session is gone
+        }
+        if (!client->scenario->own_latencies) {
+            record_latency(&client->latencies, now() - start);
+            client->ops++;
+        }
+    }
+    client->end_time = now();
+    if (client->control >= 0) {
+        send_command(client, "QUIT");
+        close(client->control);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+static u64 percentile(latencies_t *latencies, u32 percent) {
+    if (!latencies->count) return 0;
+    u32 index = ((u64)latencies->count * percent + 99) / 100;
+    return latencies->samples[index ? index - 1 : 0];
+}
+
+/*
+    Jain's fairness index over each client's rate of completed operations: 1 when every client progressed
+    at the same rate, down to 1/n when one client had all the service.
+*/
+static double fairness(client_t *clients, u32 count) {
+    double sum = 0, sum_of_squares = 0;
+    u32 i;
+    for (i = 0; i < count; i++) {
+        u64 elapsed = clients[i].end_time - clients[i].start_time;
+        double rate = elapsed ? clients[i].ops / (elapsed / 1e9) : 0;
+        sum += rate;
+        sum_of_squares += rate * rate;
+    }
+    return sum_of_squares ? sum * sum / (count * sum_of_squares) : 0;
+}
+
+static bool run_scenario(const scenario_t *scenario) {
+    u32 count = scenario->large ? (num_clients < LARGE_CLIENTS ? num_clients : LARGE_CLIENTS) : scenario->serial ? 1 : num_clients;
+    client_t *clients = calloc(count, sizeof(client_t));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    if (!clients || !threads) return false;
+    running_clients = count;
+    pthread_barrier_init(&barrier, NULL, count);
+    fprintf(stderr, "Running %s with %u clients...\n", scenario->name, count);
+    u32 i;
+    for (i = 0; i < count; i++) {
+        clients[i].index = i;
+        clients[i].control = -1;
+        clients[i].scenario = scenario;
+        clients[i].iterations = scenario->large ? scenario->iterations : scenario->iterations * scale;
+        pthread_create(threads + i, NULL, client_thread, clients + i);
+    }
+    for (i = 0; i < count; i++) pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    latencies_t all = { NULL, 0, 0 };
+    u64 bytes = 0, first_start = ~0ULL, last_end = 0;
+    u32 ops = 0, errors = 0;
+    for (i = 0; i < count; i++) {
+        u32 j;
+        for (j = 0; j < clients[i].latencies.count; j++) record_latency(&all, clients[i].latencies.samples[j]);
+        bytes += clients[i].bytes;
+        ops += clients[i].ops;
+        errors += clients[i].errors;
+        if (clients[i].start_time < first_start) first_start = clients[i].start_time;
+        if (clients[i].end_time > last_end) last_end = clients[i].end_time;
+    }
+    qsort(all.samples, all.count, sizeof(u64), compare_u64);
+    double seconds = (last_end - first_start) / 1e9;
+    printf("scenario=%s;clients=%u;ops=%u;errors=%u;bytes=%llu;seconds=%.3f;throughput_kbps=%.0f;ops_per_sec=%.1f;"
+        "latency_p50_us=%llu;latency_p99_us=%llu;latency_max_us=%llu;fairness=%.3f;\n",
+        scenario->name, count, ops, errors, bytes, seconds, seconds ? bytes / 1024.0 / seconds : 0, seconds ? ops / seconds : 0,
+        percentile(&all, 50) / 1000, percentile(&all, 99) / 1000, all.count ? all.samples[all.count - 1] / 1000 : 0, fairness(clients, count));
+    fflush(stdout);
+
+    for (i = 0; i < count; i++) free(clients[i].latencies.samples);
+    free(all.samples);
+    free(clients);
+    free(threads);
+    return !errors;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-a address] [-p port] [-P password] [-c clients] [-n scale] [-L large-MB] [-A] [scenario...]\n", program);
+    fprintf(stderr, "Scenarios:");
+    u32 i;
+    for (i = 0; i < NUM_SCENARIOS; i++) fprintf(stderr, " %s", scenarios[i].name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *address = "127.0.0.1";
+    u16 port = 2121;
+    int option;
+    while ((option = getopt(argc, argv, "a:p:P:c:n:L:A")) != -1) {
+        switch (option) {
+            case 'a': address = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'P': password = optarg; break;
+            case 'c': num_clients = atoi(optarg); break;
+            case 'n': scale = atoi(optarg); break;
+            case 'L': large_size = strtoull(optarg, NULL, 10) * 1024 * 1024; break;
+            case 'A': announce_sizes = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (!num_clients || !scale) usage(argv[0]);
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    if (!inet_aton(address, &server_address.sin_addr)) usage(argv[0]);
+
+    int arg;
+    u32 i;
+    for (arg = optind; arg < argc; arg++) {
+        for (i = 0; i < NUM_SCENARIOS && strcmp(argv[arg], scenarios[i].name); i++);
+        if (i == NUM_SCENARIOS) usage(argv[0]);
+    }
+
+    bool success = true;
+    for (i = 0; i < NUM_SCENARIOS; i++) {
+        bool selected = optind == argc;
+        for (arg = optind; arg < argc; arg++) {
+            if (!strcmp(argv[arg], scenarios[i].name)) selected = true;
+        }
+        if (selected && !run_scenario(scenarios + i)) success = false;
+    }
+    return success ? 0 : 1;
+}
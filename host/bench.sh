@@ -0,0 +1,54 @@
+#!/bin/sh
+#---------------------------------------------------------------------------------
+# Runs the benchmark scenarios against a freshly started host build, entirely on localhost.
+#
+#   host/bench.sh [results-file] [ftpii-bench options...]
+#
+# Results are one fact line per scenario, so two runs can be compared with diff.
+# BENCH_PORT picks the server's port (default 2121), and BENCH_DISC models the device's cost,
+# as latency-us:bandwidth-KB/s (e.g. 300:2000 for an SD Gecko).
+#---------------------------------------------------------------------------------
+set -e
+
+cd "$(dirname "$0")"
+make -s ftpii-host ftpii-bench
+
+results=/dev/stdout
+if [ $# -gt 0 ] && [ "${1#-}" = "$1" ]; then
+	results=$1
+	shift
+fi
+port=${BENCH_PORT:-2121}
+
+root=$(mktemp -d)
+server=
+cleanup() {
+	[ -n "$server" ] && kill "$server" 2>/dev/null && wait "$server" 2>/dev/null
+	rm -rf "$root"
+}
+trap cleanup EXIT INT TERM
+
+echo "Creating fixture in $root..." >&2
+bench=$root/carda/bench
+mkdir -p "$bench/small" "$bench/upload" "$bench/dir10k"
+i=0
+while [ $i -lt 256 ]; do
+	head -c 4096 /dev/urandom > "$bench/small/$(printf 'f%03u' $i)"
+	i=$((i + 1))
+done
+seq -f "$bench/dir10k/entry%05g" 10000 | xargs touch
+head -c $((64 * 1024 * 1024)) /dev/urandom > "$bench/large.bin"
+
+./ftpii-host -p "$port" ${BENCH_DISC:+-d "$BENCH_DISC"} "$root" > "$root/server.log" 2>&1 &
+server=$!
+tries=0
+until grep -q "Listening" "$root/server.log"; do
+	tries=$((tries + 1))
+	if [ $tries -gt 50 ] || ! kill -0 "$server" 2>/dev/null; then
+		cat "$root/server.log" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+./ftpii-bench -p "$port" "$@" > "$results"
@@ -0,0 +1,183 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#define _GNU_SOURCE // for fopencookie
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disc_model.h"
+
+#define SECTOR_SIZE 512
+#define MAX_MODELLED_DESCRIPTORS 1024
+
+/*
+    libfat can't run on the host, as glibc has no devoptab to register it with, so instead of a disc image
+    the SD Gecko's cost is modelled underneath the host directories.  Each request to the device waits
+    latency_us, plus the time its sectors take at bandwidth_kbps, and is counted into the partition's stats
+    the way fs.c counts the real device's.  A file's sectors are taken to be contiguous.
+    Requests are served one at a time, as the device would, with both slots treated as a single device.
+*/
+static u32 latency_us = 0;
+static u32 bandwidth_kbps = 0;
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void set_disc_model(u32 latency, u32 bandwidth) {
+    latency_us = latency;
+    bandwidth_kbps = bandwidth;
+}
+
+void charge_sectors(device_stats_t *stats, u64 offset, u64 length, bool write, bool success) {
+    u64 sectors = length ? (offset + length - 1) / SECTOR_SIZE - offset / SECTOR_SIZE + 1 : 0;
+    u64 ns = latency_us * 1000ULL;
+    if (bandwidth_kbps) ns += sectors * SECTOR_SIZE * 1000000000ULL / (bandwidth_kbps * 1024ULL);
+    pthread_mutex_lock(&device_lock);
+    if (ns) {
+        struct timespec wait = { ns / 1000000000ULL, ns % 1000000000ULL };
+        while (nanosleep(&wait, &wait) && errno == EINTR);
+    }
+    if (write) {
+        stats->write_ticks += ns;
+        stats->write_requests++;
+        if (success) stats->sectors_written += sectors;
+        else stats->write_errors++;
+    } else {
+        stats->read_ticks += ns;
+        stats->read_requests++;
+        if (success) stats->sectors_read += sectors;
+        else stats->read_errors++;
+    }
+    pthread_mutex_unlock(&device_lock);
+}
+
+typedef struct {
+    FILE *f;
+    FILE *stream;
+    device_stats_t *stats;
+} modelled_file_t;
+
+/*
+    On the console a libfat stream has a descriptor that write() goes through, and the uploads use it.
+    The host binary is linked with --wrap=fileno,--wrap=write, so a modelled stream's fileno is that of the
+    file underneath, and writes to it are modelled just as the stream's own are.
+*/
+static modelled_file_t *descriptors[MAX_MODELLED_DESCRIPTORS];
+static pthread_mutex_t descriptors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int __real_fileno(FILE *stream);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+
+static modelled_file_t *modelled_descriptor(int fd) {
+    if (fd < 0 || fd >= MAX_MODELLED_DESCRIPTORS) return NULL;
+    pthread_mutex_lock(&descriptors_lock);
+    modelled_file_t *file = descriptors[fd];
+    pthread_mutex_unlock(&descriptors_lock);
+    return file;
+}
+
+static void set_modelled_descriptor(int fd, modelled_file_t *file) {
+    if (fd < 0 || fd >= MAX_MODELLED_DESCRIPTORS) return;
+    pthread_mutex_lock(&descriptors_lock);
+    descriptors[fd] = file;
+    pthread_mutex_unlock(&descriptors_lock);
+}
+
+int __wrap_fileno(FILE *stream) {
+    int fd;
+    pthread_mutex_lock(&descriptors_lock);
+    for (fd = 0; fd < MAX_MODELLED_DESCRIPTORS && !(descriptors[fd] && descriptors[fd]->stream == stream); fd++);
+    pthread_mutex_unlock(&descriptors_lock);
+    return fd < MAX_MODELLED_DESCRIPTORS ? fd : __real_fileno(stream);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    modelled_file_t *file = modelled_descriptor(fd);
+    if (!file) return __real_write(fd, buf, count);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    ssize_t written = __real_write(fd, buf, count);
+    charge_sectors(file->stats, offset, written > 0 ? written : 0, true, written == (ssize_t)count);
+    return written;
+}
+
+static ssize_t read_file(void *cookie, char *buf, size_t size) {
+    modelled_file_t *file = cookie;
+    off_t offset = ftello(file->f);
+    size_t bytes_read = fread(buf, 1, size, file->f);
+    bool failed = bytes_read < size && ferror(file->f);
+    charge_sectors(file->stats, offset, bytes_read, false, !failed);
+    return failed && !bytes_read ? -1 : (ssize_t)bytes_read;
+}
+
+static ssize_t write_file(void *cookie, const char *buf, size_t size) {
+    modelled_file_t *file = cookie;
+    off_t offset = ftello(file->f);
+    size_t bytes_written = fwrite(buf, 1, size, file->f);
+    charge_sectors(file->stats, offset, bytes_written, true, bytes_written == size);
+    return bytes_written ? (ssize_t)bytes_written : -1;
+}
+
+static int seek_file(void *cookie, off64_t *offset, int whence) {
+    modelled_file_t *file = cookie;
+    if (fseeko(file->f, *offset, whence)) return -1;
+    *offset = ftello(file->f);
+    return 0;
+}
+
+static int close_file(void *cookie) {
+    modelled_file_t *file = cookie;
+    if (file->stream) set_modelled_descriptor(__real_fileno(file->f), NULL);
+    int result = fclose(file->f);
+    free(file);
+    return result;
+}
+
+/*
+    Wraps f, taking ownership of it, so that each read or write the stream makes is one modelled request.
+    f itself is left unbuffered, as the returned stream does the buffering; writing to its descriptor bypasses both.
+*/
+FILE *modelled_stream(FILE *f, const char *mode, device_stats_t *stats) {
+    modelled_file_t *file = malloc(sizeof(modelled_file_t));
+    if (!file) {
+        fclose(f);
+        errno = ENOMEM;
+        return NULL;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+    file->f = f;
+    file->stream = NULL;
+    file->stats = stats;
+    cookie_io_functions_t functions = { read_file, write_file, seek_file, close_file };
+    FILE *stream = fopencookie(file, mode, functions);
+    if (!stream) {
+        close_file(file);
+        return NULL;
+    }
+    file->stream = stream;
+    set_modelled_descriptor(__real_fileno(f), file);
+    return stream;
+}
@@ -0,0 +1,272 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "blockcache.h"
+#include "dircache.h"
+#include "disc_model.h"
+#include "fs.h"
+#include "host.h"
+#include "shared_file.h"
+#include "transfer.h"
+
+/*
+    Each virtual partition is served from a directory of the same name under the host root,
+    e.g. carda:/foo is <root>/carda/foo.  A partition is "inserted" while it is mounted,
+    and it can only be mounted while its directory exists.
+*/
+VIRTUAL_PARTITION VIRTUAL_PARTITIONS[] = {
+    { "SD Gecko A", "/carda", "carda", "carda:/", false, false, NULL },
+    { "SD Gecko B", "/cardb", "cardb", "cardb:/", false, false, NULL },
+};
+const u32 MAX_VIRTUAL_PARTITIONS = (sizeof(VIRTUAL_PARTITIONS) / sizeof(VIRTUAL_PARTITION));
+
+VIRTUAL_PARTITION *PA_GCSDA   = VIRTUAL_PARTITIONS + 0;
+VIRTUAL_PARTITION *PA_GCSDB   = VIRTUAL_PARTITIONS + 1;
+
+static const char *host_root = ".";
+static u32 host_cluster_size = 0; // 0 for the host filesystem's own
+
+void set_host_root(const char *root) {
+    host_root = root;
+}
+
+/*
+    Makes statvfs report clusters of bytes instead of the host filesystem's blocks, to stand in for cards formatted with bigger ones.
+*/
+void set_host_cluster_size(u32 bytes) {
+    host_cluster_size = bytes;
+}
+
+/*
+    Maps a real path on a virtual partition to its host path in buffer, which must hold PATH_MAX, and sets *partition.
+    Other paths are returned unchanged, with *partition NULL.  Returns NULL with errno set if the partition is not mounted.
+*/
+static const char *host_path(const char *path, char *buffer, VIRTUAL_PARTITION **partition_out) {
+    *partition_out = NULL;
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
+        VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + i;
+        size_t prefix_len = strlen(partition->prefix);
+        if (strncmp(partition->prefix, path, prefix_len)) continue;
+        if (!partition->inserted) {
+            errno = ENODEV;
+            return NULL;
+        }
+        if (snprintf(buffer, PATH_MAX, "%s/%s/%s", host_root, partition->mount_point, path + prefix_len) >= PATH_MAX) {
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+        *partition_out = partition;
+        return buffer;
+    }
+    return path;
+}
+
+/*
+    File data goes through the disc model, and each metadata operation is charged as a one-sector request.
+*/
+static void charge_metadata(VIRTUAL_PARTITION *partition, bool write, bool success) {
+    if (partition) charge_sectors(&partition->stats, 0, 1, write, success);
+}
+
+FILE *host_fopen(const char *path, const char *mode) {
+    char buffer[PATH_MAX];
+    VIRTUAL_PARTITION *partition;
+    const char *mapped = host_path(path, buffer, &partition);
+    if (!mapped) return NULL;
+    FILE *f = fopen(mapped, mode);
+    return f && partition ? modelled_stream(f, mode, &partition->stats) : f;
+}
+
+int host_stat(const char *path, struct stat *st) {
+    char buffer[PATH_MAX];
+    VIRTUAL_PARTITION *partition;
+    const char *mapped = host_path(path, buffer, &partition);
+    if (!mapped) return -1;
+    int result = stat(mapped, st);
+    charge_metadata(partition, false, !result || errno == ENOENT);
+    return result;
+}
+
+DIR *host_opendir(const char *path) {
+    char buffer[PATH_MAX];
+    VIRTUAL_PARTITION *partition;
+    const char *mapped = host_path(path, buffer, &partition);
+    if (!mapped) return NULL;
+    DIR *dir = opendir(mapped);
+    charge_metadata(partition, false, dir || errno == ENOENT);
+    return dir;
+}
+
+int host_unlink(const char *path) {
+    char buffer[PATH_MAX];
+    VIRTUAL_PARTITION *partition;
+    const char *mapped = host_path(path, buffer, &partition);
+    if (!mapped) return -1;
+    int result = unlink(mapped);
+    charge_metadata(partition, !result, !result || errno == ENOENT); // a missing file is only looked up
+    return result;
+}
+
+int host_mkdir(const char *path, mode_t mode) {
+    char buffer[PATH_MAX];
+    VIRTUAL_PARTITION *partition;
+    const char *mapped = host_path(path, buffer, &partition);
+    if (!mapped) return -1;
+    int result = mkdir(mapped, mode);
+    charge_metadata(partition, true, !result);
+    return result;
+}
+
+int host_rename(const char *from, const char *to) {
+    char from_buffer[PATH_MAX], to_buffer[PATH_MAX];
+    VIRTUAL_PARTITION *from_partition, *to_partition;
+    const char *from_mapped = host_path(from, from_buffer, &from_partition);
+    const char *to_mapped = host_path(to, to_buffer, &to_partition);
+    if (!from_mapped || !to_mapped) return -1;
+    int result = rename(from_mapped, to_mapped);
+    charge_metadata(from_partition, true, !result);
+    return result;
+}
+
+int host_statvfs(const char *path, struct statvfs *st) {
+    char buffer[PATH_MAX];
+    VIRTUAL_PARTITION *partition;
+    const char *mapped = host_path(path, buffer, &partition);
+    if (!mapped) return -1;
+    int result = statvfs(mapped, st);
+    charge_metadata(partition, false, !result);
+    if (!result && host_cluster_size) {
+        st->f_bavail = (u64)st->f_bavail * st->f_frsize / host_cluster_size;
+        st->f_bfree = (u64)st->f_bfree * st->f_frsize / host_cluster_size;
+        st->f_blocks = (u64)st->f_blocks * st->f_frsize / host_cluster_size;
+        st->f_bsize = st->f_frsize = host_cluster_size;
+    }
+    return result;
+}
+
+static VIRTUAL_PARTITION *to_virtual_partition(const char *virtual_prefix) {
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++)
+        if (!strcasecmp(VIRTUAL_PARTITIONS[i].alias, virtual_prefix))
+            return &VIRTUAL_PARTITIONS[i];
+    return NULL;
+}
+
+bool mounted(VIRTUAL_PARTITION *partition) {
+    return partition->inserted;
+}
+
+bool mount(VIRTUAL_PARTITION *partition) {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", host_root, partition->mount_point);
+    partition->inserted = !stat(path, &st) && S_ISDIR(st.st_mode);
+    if (partition->inserted) printf("Serving %s as %s.\n", path, partition->alias);
+    return partition->inserted;
+}
+
+bool mount_virtual(const char *dir) {
+    VIRTUAL_PARTITION *partition = to_virtual_partition(dir);
+    return partition && mount(partition);
+}
+
+bool unmount(VIRTUAL_PARTITION *partition) {
+    if (transfers_open_under(partition->prefix) || shared_files_open_under(partition->prefix)) {
+        errno = EBUSY;
+        return false;
+    }
+    dircache_flush(partition->prefix);
+    blockcache_flush(partition->prefix);
+    shared_file_flush(partition->prefix);
+    partition->inserted = false;
+    partition->cluster_size = 0;
+    return true;
+}
+
+bool unmount_virtual(const char *dir) {
+    VIRTUAL_PARTITION *partition = to_virtual_partition(dir);
+    errno = EINVAL;
+    return partition && unmount(partition);
+}
+
+/*
+    There is no sector cache to retune here, but a busy partition is refused as it is on the console.
+*/
+bool retune_cache(const char *dir, const char *setting) {
+    VIRTUAL_PARTITION *partition = to_virtual_partition(dir);
+    bool busy = partition && (transfers_open_under(partition->prefix) || shared_files_open_under(partition->prefix));
+    errno = busy ? EBUSY : ENOSYS;
+    return false;
+}
+
+/*
+    Host directories don't come and go, so there is nothing to poll for.
+*/
+void check_removable_devices(u64 now) {
+}
+
+u64 next_fs_timer() {
+    return ~(u64)0;
+}
+
+void process_remount_event() {
+}
+
+void process_device_select_event(u32 pressed) {
+}
+
+void check_mount_timer(u64 now) {
+}
+
+/*
+    Partitions here have no sectors, so there is no sector cache for the budget to be spent on.
+*/
+void initialise_fs(u32 memory_budget) {
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) mount(VIRTUAL_PARTITIONS + i);
+}
+
+s32 write_mounts(stats_line_writer write, void *arg) {
+    s32 result = 0;
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS && result >= 0; i++) {
+        VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + i;
+        char line[PATH_MAX + 80];
+        snprintf(line, sizeof(line), "alias=%s;name=%s;inserted=%u;mounted=%u;directory=%s/%s;",
+            partition->alias, partition->name, partition->inserted, mounted(partition), host_root, partition->mount_point);
+        result = write(arg, line);
+    }
+    return result;
+}
@@ -0,0 +1,101 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ogc/lwp_watchdog.h>
+
+#include "blockcache.h"
+#include "disc_model.h"
+#include "fs.h"
+#include "ftp.h"
+#include "host.h"
+#include "log.h"
+#include "net.h"
+#include "reset.h"
+
+/*
+    Runs the server as an ordinary process, serving <root>/carda and <root>/cardb,
+    so that the protocol and VFS code can be profiled on a workstation.
+*/
+
+static const u16 DEFAULT_PORT = 2121;
+static const u32 POLL_INTERVAL_MS = 1000;
+static const u32 SESSION_MEMORY_BUDGET = 24 * 1024;
+static const u32 CACHE_MEMORY_BUDGET = 512 * 1024;
+static const u32 DEFAULT_BLOCKCACHE_KB = 4 * 1024;
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-p port] [-P password] [-d latency-us:bandwidth-KB/s] [-c block-cache-KB] [-k cluster-KB] [root]\n", program);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    u16 port = DEFAULT_PORT;
+    char *password = NULL;
+    int option;
+    u32 latency_us, bandwidth_kbps;
+    u32 blockcache_kb = DEFAULT_BLOCKCACHE_KB;
+    while ((option = getopt(argc, argv, "p:P:d:c:k:")) != -1) {
+        if (option == 'p') port = atoi(optarg);
+        else if (option == 'P') password = optarg;
+        else if (option == 'd' && sscanf(optarg, "%u:%u", &latency_us, &bandwidth_kbps) == 2) set_disc_model(latency_us, bandwidth_kbps);
+        else if (option == 'c') blockcache_kb = atoi(optarg);
+        else if (option == 'k') set_host_cluster_size(atoi(optarg) * 1024);
+        else usage(argv[0]);
+    }
+    if (optind < argc - 1) usage(argv[0]);
+    if (optind < argc) set_host_root(argv[optind]);
+
+    setvbuf(stdout, NULL, _IOLBF, 0); // like the console, even when redirected to a file
+    initialise_log();
+    initialise_reset_buttons();
+    initialise_network();
+    initialise_fs(CACHE_MEMORY_BUDGET);
+    initialise_blockcache(blockcache_kb * 1024);
+    initialise_ftp(SESSION_MEMORY_BUDGET);
+    set_ftp_password(password);
+
+    s32 server = create_server(port);
+    if (server < 0) return 1;
+    printf("Listening on TCP port %u...\n", port);
+    s32 wakeup = open_wakeup(port);
+    if (wakeup < 0) log_warning(LOG_FTP, "Unable to open a loopback wakeup socket: [%i] %s; polling transfers instead.", -wakeup, strerror(-wakeup));
+
+    while (!reset()) {
+        if (process_ftp_events(server, gettime() + millisecs_to_ticks(POLL_INTERVAL_MS))) {
+            printf("Network error, exiting.\n");
+            break;
+        }
+        if (!ftp_transfers_active()) log_drain();
+    }
+    cleanup_ftp();
+    net_close(server);
+    close_wakeup();
+    log_drain();
+    return 0;
+}
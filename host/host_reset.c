@@ -0,0 +1,70 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "reset.h"
+
+/*
+    Stands in for the console's reset and power buttons: SIGINT and SIGTERM ask the
+    server to shut down, as pressing reset does.
+*/
+
+static volatile sig_atomic_t _reset = 0;
+
+u8 reset() {
+    return _reset;
+}
+
+void set_reset_flag() {
+    _reset = 1;
+}
+
+static void handle_signal(int signal) {
+    set_reset_flag();
+}
+
+void initialise_reset_buttons() {
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+bool check_reset_synchronous() {
+    return _reset;
+}
+
+void maybe_poweroff() {
+}
+
+void die(char *msg, int errnum) {
+    log_drain();
+    printf("%s: [%i] %s\n", msg, errnum, strerror(errnum));
+    exit(1);
+}
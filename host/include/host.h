@@ -0,0 +1,47 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <gctypes.h>
+
+void set_host_root(const char *root);
+void set_host_cluster_size(u32 bytes);
+
+FILE *host_fopen(const char *path, const char *mode);
+int host_stat(const char *path, struct stat *st);
+DIR *host_opendir(const char *path);
+int host_unlink(const char *path);
+int host_mkdir(const char *path, mode_t mode);
+int host_rename(const char *from, const char *to);
+int host_statvfs(const char *path, struct statvfs *st);
+
+#endif /* _HOST_H_ */
@@ -0,0 +1,51 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _HOST_PATHS_H_
+#define _HOST_PATHS_H_
+
+/*
+    Forced into each of the shared sources by the host Makefile.
+    Real paths keep the console's device form, e.g. "carda:/foo", so that vrt and dircache behave exactly as they do there,
+    and the calls that take one are redirected to host_fs.c to be mapped onto a host directory.
+    The system headers come first so that their own declarations are not rewritten.
+*/
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "host.h"
+
+#define fopen(path, mode) host_fopen(path, mode)
+#define stat(path, st) host_stat(path, st)
+#define opendir(path) host_opendir(path)
+#define unlink(path) host_unlink(path)
+#define mkdir(path, mode) host_mkdir(path, mode)
+#define rename(from, to) host_rename(from, to)
+#define statvfs(path, st) host_statvfs(path, st)
+
+#endif /* _HOST_PATHS_H_ */
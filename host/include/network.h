@@ -0,0 +1,57 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _NETWORK_H_
+#define _NETWORK_H_
+
+/*
+    Host stand-in for libogc's network.h.  The net_* calls map onto BSD sockets and,
+    like libogc's, return a negated errno on failure rather than setting errno.
+*/
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <gctypes.h>
+
+s32 net_socket(u32 domain, u32 type, u32 protocol);
+s32 net_bind(s32 s, struct sockaddr *name, socklen_t namelen);
+s32 net_listen(s32 s, u32 backlog);
+s32 net_accept(s32 s, struct sockaddr *addr, socklen_t *addrlen);
+s32 net_connect(s32 s, struct sockaddr *addr, socklen_t addrlen);
+s32 net_read(s32 s, void *mem, s32 len);
+s32 net_write(s32 s, const void *data, s32 size);
+s32 net_close(s32 s);
+s32 net_ioctl(s32 s, u32 cmd, void *argp);
+s32 net_setsockopt(s32 s, u32 level, u32 optname, const void *optval, socklen_t optlen);
+s32 net_select(s32 maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout);
+u32 net_gethostip();
+s32 if_configex(struct in_addr *local_ip, struct in_addr *netmask, struct in_addr *gateway, bool use_dhcp);
+
+#endif /* _NETWORK_H_ */
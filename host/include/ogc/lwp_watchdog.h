@@ -0,0 +1,49 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _LWP_WATCHDOG_H_
+#define _LWP_WATCHDOG_H_
+
+/*
+    Host stand-in for libogc's lwp_watchdog.h.  A tick is one nanosecond of CLOCK_MONOTONIC.
+*/
+#include <gctypes.h>
+
+#define TB_TIMER_CLOCK 1000000ULL // ticks per millisecond
+
+#define secs_to_ticks(sec) ((u64)(sec) * TB_TIMER_CLOCK * 1000)
+#define millisecs_to_ticks(msec) ((u64)(msec) * TB_TIMER_CLOCK)
+#define microsecs_to_ticks(usec) ((u64)(usec) * (TB_TIMER_CLOCK / 1000))
+#define ticks_to_secs(ticks) ((u64)(ticks) / (TB_TIMER_CLOCK * 1000))
+#define ticks_to_millisecs(ticks) ((u64)(ticks) / TB_TIMER_CLOCK)
+#define ticks_to_microsecs(ticks) ((u64)(ticks) / (TB_TIMER_CLOCK / 1000))
+
+u64 gettime();
+u32 diff_sec(u64 start, u64 end);
+u32 diff_msec(u64 start, u64 end);
+u32 diff_usec(u64 start, u64 end);
+u64 diff_ticks(u64 start, u64 end);
+
+#endif /* _LWP_WATCHDOG_H_ */
@@ -0,0 +1,221 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <malloc.h>
+#include <net/if.h>
+#include <network.h>
+#include <ogc/cond.h>
+#include <ogc/lwp.h>
+#include <ogc/lwp_watchdog.h>
+#include <ogc/mutex.h>
+#include <string.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+    The libogc calls used by the shared sources, implemented over POSIX.
+*/
+
+u64 gettime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+u64 diff_ticks(u64 start, u64 end) {
+    return end - start;
+}
+
+u32 diff_sec(u64 start, u64 end) {
+    return ticks_to_secs(end - start);
+}
+
+u32 diff_msec(u64 start, u64 end) {
+    return ticks_to_millisecs(end - start);
+}
+
+u32 diff_usec(u64 start, u64 end) {
+    return ticks_to_microsecs(end - start);
+}
+
+static s32 net_result(s32 result) {
+    return result < 0 ? -errno : result;
+}
+
+/*
+    Sockets are opened with SO_REUSEADDR so that the server and the passive port range can be rebound
+    straight after a restart, as they can be on the console.
+*/
+s32 net_socket(u32 domain, u32 type, u32 protocol) {
+    s32 s = socket(domain, type, protocol);
+    if (s < 0) return -errno;
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    return s;
+}
+
+/*
+    The console has no privileged ports, so where a process without the privilege asks for one
+    (e.g. port 20 as the source of active-mode data connections), any port will do instead.
+*/
+s32 net_bind(s32 s, struct sockaddr *name, socklen_t namelen) {
+    s32 result = net_result(bind(s, name, namelen));
+    struct sockaddr_in *address = (struct sockaddr_in *)name;
+    if (result == -EACCES && address->sin_family == AF_INET && ntohs(address->sin_port) < 1024) {
+        struct sockaddr_in any_port = *address;
+        any_port.sin_port = 0;
+        result = net_result(bind(s, (struct sockaddr *)&any_port, sizeof(any_port)));
+    }
+    return result;
+}
+
+s32 net_listen(s32 s, u32 backlog) {
+    return net_result(listen(s, backlog));
+}
+
+s32 net_accept(s32 s, struct sockaddr *addr, socklen_t *addrlen) {
+    return net_result(accept(s, addr, addrlen));
+}
+
+s32 net_connect(s32 s, struct sockaddr *addr, socklen_t addrlen) {
+    return net_result(connect(s, addr, addrlen));
+}
+
+s32 net_read(s32 s, void *mem, s32 len) {
+    return net_result(recv(s, mem, len, 0));
+}
+
+s32 net_write(s32 s, const void *data, s32 size) {
+    return net_result(send(s, data, size, MSG_NOSIGNAL));
+}
+
+s32 net_close(s32 s) {
+    return net_result(close(s));
+}
+
+s32 net_ioctl(s32 s, u32 cmd, void *argp) {
+    return net_result(ioctl(s, cmd, argp));
+}
+
+s32 net_setsockopt(s32 s, u32 level, u32 optname, const void *optval, socklen_t optlen) {
+    return net_result(setsockopt(s, level, optname, optval, optlen));
+}
+
+s32 net_select(s32 maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout) {
+    return net_result(select(maxfdp1, readset, writeset, exceptset, timeout));
+}
+
+/*
+    Returns the first non-loopback IPv4 address that is up, in network byte order, or the loopback address if there is none.
+*/
+u32 net_gethostip() {
+    u32 ip = htonl(INADDR_LOOPBACK);
+    struct ifaddrs *interfaces;
+    if (getifaddrs(&interfaces)) return ip;
+    struct ifaddrs *interface;
+    for (interface = interfaces; interface; interface = interface->ifa_next) {
+        if (!interface->ifa_addr || interface->ifa_addr->sa_family != AF_INET) continue;
+        if (!(interface->ifa_flags & IFF_UP) || (interface->ifa_flags & IFF_LOOPBACK)) continue;
+        ip = ((struct sockaddr_in *)interface->ifa_addr)->sin_addr.s_addr;
+        break;
+    }
+    freeifaddrs(interfaces);
+    return ip;
+}
+
+/*
+    The host's network is already up.
+*/
+s32 if_configex(struct in_addr *local_ip, struct in_addr *netmask, struct in_addr *gateway, bool use_dhcp) {
+    if (local_ip) local_ip->s_addr = net_gethostip();
+    return 0;
+}
+
+s32 LWP_CreateThread(lwp_t *thethread, void *(*entry)(void *), void *arg, void *stackbase, u32 stack_size, u8 prio) {
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    if (stack_size) pthread_attr_setstacksize(&attributes, stack_size < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : stack_size);
+    s32 result = pthread_create(thethread, &attributes, entry, arg);
+    pthread_attr_destroy(&attributes);
+    return -result;
+}
+
+s32 LWP_JoinThread(lwp_t thethread, void **value_ptr) {
+    return -pthread_join(thethread, value_ptr);
+}
+
+s32 LWP_MutexInit(mutex_t *mutex, bool use_recursive) {
+    pthread_mutexattr_t attributes;
+    if (!(*mutex = malloc(sizeof(pthread_mutex_t)))) return -ENOMEM;
+    pthread_mutexattr_init(&attributes);
+    if (use_recursive) pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    s32 result = pthread_mutex_init(*mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    if (result) free(*mutex);
+    return -result;
+}
+
+s32 LWP_MutexDestroy(mutex_t mutex) {
+    s32 result = pthread_mutex_destroy(mutex);
+    free(mutex);
+    return -result;
+}
+
+s32 LWP_MutexLock(mutex_t mutex) {
+    return -pthread_mutex_lock(mutex);
+}
+
+s32 LWP_MutexUnlock(mutex_t mutex) {
+    return -pthread_mutex_unlock(mutex);
+}
+
+s32 LWP_CondInit(cond_t *cond) {
+    if (!(*cond = malloc(sizeof(pthread_cond_t)))) return -ENOMEM;
+    s32 result = pthread_cond_init(*cond, NULL);
+    if (result) free(*cond);
+    return -result;
+}
+
+s32 LWP_CondWait(cond_t cond, mutex_t mutex) {
+    return -pthread_cond_wait(cond, mutex);
+}
+
+s32 LWP_CondSignal(cond_t cond) {
+    return -pthread_cond_signal(cond);
+}
+
+s32 LWP_CondBroadcast(cond_t cond) {
+    return -pthread_cond_broadcast(cond);
+}
+
+s32 LWP_CondDestroy(cond_t cond) {
+    s32 result = pthread_cond_destroy(cond);
+    free(cond);
+    return -result;
+}
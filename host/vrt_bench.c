@@ -0,0 +1,189 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gctypes.h>
+
+#include "fs.h"
+#include "vrt.h"
+
+/*
+    A micro-benchmark of path resolution: the per-call cost of vrt_resolve against the resolver it replaced,
+    for a deep working directory and a relative path that mixes ".", ".." and plain components.
+    Prints one fact line per depth, so that runs against different builds can be diffed.
+*/
+
+#define CALLS 200000
+#define LEGACY_PATH_MAX 1024 // the old resolver only ever saw newlib's PATH_MAX
+
+/*
+    The resolver as it was before vrt_resolve: up to three mallocs a call, and an output
+    built one character at a time with strncat.  Kept here only to be measured against.
+*/
+static char *legacy_virtual_abspath(char *virtual_cwd, char *virtual_path) {
+    char *path;
+    if (virtual_path[0] == '/') {
+        path = virtual_path;
+    } else {
+        size_t path_size = strlen(virtual_cwd) + strlen(virtual_path) + 1;
+        if (path_size > LEGACY_PATH_MAX || !(path = malloc(path_size))) return NULL;
+        strcpy(path, virtual_cwd);
+        strcat(path, virtual_path);
+    }
+
+    char *normalised_path = malloc(strlen(path) + 1);
+    if (!normalised_path) goto end;
+    *normalised_path = '\0';
+    char *curr_dir = normalised_path;
+
+    u32 state = 0; // 0:start, 1:slash, 2:dot, 3:dotdot
+    char *token = path;
+    while (1) {
+        switch (state) {
+        case 0:
+            if (*token == '/') {
+                state = 1;
+                curr_dir = normalised_path + strlen(normalised_path);
+                strncat(normalised_path, token, 1);
+            }
+            break;
+        case 1:
+            if (*token == '.') state = 2;
+            else if (*token != '/') state = 0;
+            break;
+        case 2:
+            if (*token == '/' || !*token) {
+                state = 1;
+                *(curr_dir + 1) = '\0';
+            } else if (*token == '.') state = 3;
+            else state = 0;
+            break;
+        case 3:
+            if (*token == '/' || !*token) {
+                state = 1;
+                *curr_dir = '\0';
+                char *prev_dir = strrchr(normalised_path, '/');
+                if (prev_dir) curr_dir = prev_dir;
+                else *curr_dir = '/';
+                *(curr_dir + 1) = '\0';
+            } else state = 0;
+            break;
+        }
+        if (!*token) break;
+        if (state == 0 || *token != '/') strncat(normalised_path, token, 1);
+        token++;
+    }
+
+    u32 end = strlen(normalised_path);
+    while (end > 1 && normalised_path[end - 1] == '/') {
+        normalised_path[--end] = '\x00';
+    }
+
+    end:
+    if (path != virtual_path) free(path);
+    return normalised_path;
+}
+
+static char *legacy_to_real_path(char *virtual_cwd, char *virtual_path) {
+    if (strchr(virtual_path, ':')) return NULL;
+
+    virtual_path = legacy_virtual_abspath(virtual_cwd, virtual_path);
+    if (!virtual_path) return NULL;
+
+    char *path = NULL;
+    char *rest = virtual_path;
+    const char *prefix = NULL;
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
+        VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + i;
+        const char *alias = partition->alias;
+        size_t alias_len = strlen(alias);
+        if (!strcasecmp(alias, virtual_path) || (!strncasecmp(alias, virtual_path, alias_len) && virtual_path[alias_len] == '/')) {
+            prefix = partition->prefix;
+            rest += alias_len;
+            if (*rest == '/') rest++;
+            break;
+        }
+    }
+    if (prefix && strlen(prefix) + strlen(rest) + 1 <= LEGACY_PATH_MAX && (path = malloc(strlen(prefix) + strlen(rest) + 1))) {
+        strcpy(path, prefix);
+        strcat(path, rest);
+    }
+    free(virtual_path);
+    return path;
+}
+
+static u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+    A cwd of depth directories under /carda, and a path that goes depth components deeper in steps of
+    "name/./", "../" and "name/", so that both resolvers have to back up as well as descend.
+*/
+static void make_case(u32 depth, char *cwd, char *path) {
+    u32 i;
+    strcpy(cwd, "/carda/");
+    for (i = 0; i < depth; i++) sprintf(cwd + strlen(cwd), "directory%02u/", i);
+    *path = '\0';
+    for (i = 0; i < depth; i++) sprintf(path + strlen(path), "sub%02u/./%sfile%02u", i, i % 2 ? "../" : "", i);
+    for (i = 0; i + 1 < depth; i++) strcat(path, i % 2 ? "/" : "/../");
+}
+
+int main(int argc, char **argv) {
+    static const u32 depths[] = { 4, 16, 28 };
+    u32 d;
+    for (d = 0; d < sizeof(depths) / sizeof(*depths); d++) {
+        char cwd[LEGACY_PATH_MAX], path[LEGACY_PATH_MAX];
+        make_case(depths[d], cwd, path);
+
+        vrt_path_t resolved;
+        char *legacy = legacy_to_real_path(cwd, path);
+        if (!legacy || vrt_resolve(cwd, path, &resolved) || strcmp(legacy, resolved.real_path)) {
+            fprintf(stderr, "Resolvers disagree at depth %u: %s, %s\n", depths[d], legacy, resolved.real_path);
+            return 1;
+        }
+        free(legacy);
+
+        u32 i;
+        u64 start = now_ns();
+        for (i = 0; i < CALLS; i++) free(legacy_to_real_path(cwd, path));
+        u64 legacy_ns = now_ns() - start;
+        start = now_ns();
+        for (i = 0; i < CALLS; i++) vrt_resolve(cwd, path, &resolved);
+        u64 resolve_ns = now_ns() - start;
+
+        printf("depth=%u;cwd_chars=%zu;path_chars=%zu;calls=%u;legacy_ns_per_call=%llu;vrt_resolve_ns_per_call=%llu;\n",
+            depths[d], strlen(cwd), strlen(path), CALLS, legacy_ns / CALLS, resolve_ns / CALLS);
+    }
+    return 0;
+}
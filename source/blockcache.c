@@ -0,0 +1,227 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <ctype.h>
+#include <malloc.h>
+#include <ogc/mutex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/dirent.h>
+
+#include "blockcache.h"
+
+/*
+    One BLOCKCACHE_BLOCK_SIZE-aligned block of a file, keyed by the file's real path (e.g. "carda:/foo.iso").
+    Paths compare without regard to case, as FAT names do.
+    length is less than the block size only for the last block of a file.  A slot with no path is free;
+    its data is kept for reuse.  hits counts reads served from the block.
+*/
+typedef struct {
+    char *path;
+    u32 hash;
+    u64 offset;
+    u32 length;
+    u32 hits;
+    u64 last_used;
+    u8 *data;
+} cached_block_t;
+
+/*
+    Shared by every download thread, so everything is protected by lock and block contents are copied under it.
+    Anything invalidated bumps generation, so that a block read from the file before then is never inserted.
+*/
+static cached_block_t *blocks = NULL;
+static u32 max_blocks = 0;
+static u32 num_blocks = 0;
+static u32 generation = 0;
+static u64 use_counter = 0;
+static mutex_t lock;
+
+static u32 hash_path(const char *path) {
+    u32 hash = 2166136261u;
+    while (*path) hash = (hash ^ (u8)tolower((u8)*path++)) * 16777619u;
+    return hash;
+}
+
+/*
+    Caches up to memory_budget bytes of file blocks.  A budget under one block disables the cache.
+*/
+void initialise_blockcache(u32 memory_budget) {
+    max_blocks = memory_budget / BLOCKCACHE_BLOCK_SIZE;
+    if (max_blocks && !(blocks = calloc(max_blocks, sizeof(cached_block_t)))) max_blocks = 0;
+    LWP_MutexInit(&lock, false);
+}
+
+static s32 find_block(const char *path, u32 hash, u64 offset) {
+    u32 i;
+    for (i = 0; i < max_blocks; i++) {
+        cached_block_t *block = blocks + i;
+        if (block->path && block->hash == hash && block->offset == offset && !strcasecmp(block->path, path)) return i;
+    }
+    return -1;
+}
+
+static void remove_block(cached_block_t *block) {
+    free(block->path);
+    block->path = NULL;
+    num_blocks--;
+}
+
+/*
+    Copies the cached block of path starting at offset, which must be block-aligned, into buffer.
+    Returns its length, or BLOCKCACHE_MISS.
+*/
+s32 blockcache_read(const char *path, u64 offset, void *buffer) {
+    s32 result = BLOCKCACHE_MISS;
+    LWP_MutexLock(lock);
+    s32 index = find_block(path, hash_path(path), offset);
+    if (index >= 0) {
+        cached_block_t *block = blocks + index;
+        memcpy(buffer, block->data, block->length);
+        block->last_used = ++use_counter;
+        block->hits++;
+        result = block->length;
+        blockcache_stats.hits++;
+        blockcache_stats.bytes += block->length;
+    } else if (max_blocks) {
+        blockcache_stats.misses++;
+    }
+    LWP_MutexUnlock(lock);
+    return result;
+}
+
+/*
+    To be taken before reading a block from the file, and passed to blockcache_insert afterwards.
+*/
+u32 blockcache_generation() {
+    LWP_MutexLock(lock);
+    u32 result = generation;
+    LWP_MutexUnlock(lock);
+    return result;
+}
+
+/*
+    Caches length bytes read from path at offset, evicting the least recently used block if the cache is full.
+    That block is kept instead if it belongs to the same file and has never been hit: a download of a file
+    larger than the cache would otherwise evict its own start, leaving nothing for the next download of it.
+    Does nothing if path has been invalidated since generation was taken.
+*/
+void blockcache_insert(const char *path, u64 offset, const void *buffer, u32 length, u32 generation_before_read) {
+    if (!max_blocks || !length || length > BLOCKCACHE_BLOCK_SIZE) return;
+    LWP_MutexLock(lock);
+    u32 hash = hash_path(path);
+    if (generation_before_read != generation || find_block(path, hash, offset) >= 0) goto done;
+
+    cached_block_t *slot = NULL;
+    u32 i;
+    for (i = 0; i < max_blocks; i++) {
+        cached_block_t *block = blocks + i;
+        if (!block->path) {
+            if (!slot || (!slot->data && block->data)) slot = block;
+        } else if (num_blocks == max_blocks && (!slot || block->last_used < slot->last_used)) {
+            slot = block;
+        }
+    }
+    if (slot->path) {
+        if (!slot->hits && slot->hash == hash && !strcasecmp(slot->path, path)) goto done;
+        remove_block(slot);
+        blockcache_stats.evictions++;
+    }
+    if (!slot->data && !(slot->data = memalign(32, BLOCKCACHE_BLOCK_SIZE))) goto done;
+    if (!(slot->path = strdup(path))) goto done;
+    slot->hash = hash;
+    slot->offset = offset;
+    slot->length = length;
+    slot->hits = 0;
+    slot->last_used = ++use_counter;
+    memcpy(slot->data, buffer, length);
+    num_blocks++;
+    blockcache_stats.insertions++;
+
+    done:
+    LWP_MutexUnlock(lock);
+}
+
+/*
+    Forgets every block of path, and of everything below it should it be a directory.
+*/
+void blockcache_invalidate(const char *path) {
+    LWP_MutexLock(lock);
+    generation++;
+    u32 length = strlen(path);
+    u32 i;
+    for (i = 0; i < max_blocks; i++) {
+        cached_block_t *block = blocks + i;
+        if (block->path && !strncasecmp(block->path, path, length) && (!block->path[length] || block->path[length] == '/')) {
+            remove_block(block);
+            blockcache_stats.invalidations++;
+        }
+    }
+    LWP_MutexUnlock(lock);
+}
+
+/*
+    Forgets every block of every file whose path begins with prefix, e.g. when a device is unmounted.
+*/
+void blockcache_flush(const char *prefix) {
+    LWP_MutexLock(lock);
+    generation++;
+    u32 length = strlen(prefix);
+    u32 i;
+    for (i = 0; i < max_blocks; i++) {
+        if (blocks[i].path && !strncasecmp(blocks[i].path, prefix, length)) remove_block(blocks + i);
+    }
+    LWP_MutexUnlock(lock);
+}
+
+/*
+    Writes a summary line and then one fact line per cached file, for /ftpii/blockcache.
+*/
+s32 blockcache_write_state(stats_line_writer write, void *arg) {
+    char line[PATH_MAX + 80];
+    LWP_MutexLock(lock);
+    snprintf(line, sizeof(line), "blocks=%u;blocks.max=%u;block_size=%u;generation=%u;",
+        num_blocks, max_blocks, BLOCKCACHE_BLOCK_SIZE, generation);
+    s32 result = write(arg, line);
+    u32 i, j;
+    for (i = 0; i < max_blocks && result >= 0; i++) {
+        if (!blocks[i].path) continue;
+        for (j = 0; j < i && (!blocks[j].path || strcasecmp(blocks[j].path, blocks[i].path)); j++);
+        if (j < i) continue;
+        u32 file_blocks = 0;
+        u64 bytes = 0;
+        for (j = i; j < max_blocks; j++) {
+            if (blocks[j].path && !strcasecmp(blocks[j].path, blocks[i].path)) {
+                file_blocks++;
+                bytes += blocks[j].length;
+            }
+        }
+        snprintf(line, sizeof(line), "blocks=%u;bytes=%llu;path=%s;", file_blocks, bytes, blocks[i].path);
+        result = write(arg, line);
+    }
+    LWP_MutexUnlock(lock);
+    return result;
+}
@@ -0,0 +1,50 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _BLOCKCACHE_H_
+#define _BLOCKCACHE_H_
+
+#include <gctypes.h>
+
+#include "stats.h"
+
+#define BLOCKCACHE_BLOCK_SIZE 32768
+#define BLOCKCACHE_MISS -1
+
+void initialise_blockcache(u32 memory_budget);
+
+s32 blockcache_read(const char *path, u64 offset, void *buffer);
+
+u32 blockcache_generation();
+
+void blockcache_insert(const char *path, u64 offset, const void *buffer, u32 length, u32 generation_before_read);
+
+void blockcache_invalidate(const char *path);
+
+void blockcache_flush(const char *prefix);
+
+s32 blockcache_write_state(stats_line_writer write, void *arg);
+
+#endif /* _BLOCKCACHE_H_ */
@@ -0,0 +1,319 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gctypes.h>
+
+#include "dircache.h"
+
+#define DIRCACHE_MAX_DIRS 32
+#define DIRCACHE_MAX_ENTRIES 8192
+
+typedef struct {
+    u32 name;
+    u8 type;
+    bool stat_valid;
+    struct stat st;
+} cached_entry_t;
+
+/*
+    The contents of one directory, keyed by its real path (e.g. "carda:/foo" or "carda:/").
+    Entry names live back to back in the names arena and entries are kept sorted by name.
+    Paths and names compare ignoring case, as FAT does, so "carda:/SUB" finds "carda:/sub".
+    A directory is pinned while users is non-zero, and is not in the cache at all while it is still being built.
+    Anything invalidated bumps generation, so that a directory begun before then is never inserted.
+*/
+struct cached_dir_struct {
+    char *path;
+    cached_entry_t *entries;
+    u32 num_entries;
+    u32 entries_capacity;
+    char *names;
+    u32 names_length;
+    u32 names_capacity;
+    u32 users;
+    u32 generation;
+    bool building;
+    bool cached;
+    u64 last_used;
+};
+
+static cached_dir_t *dirs[DIRCACHE_MAX_DIRS] = { NULL };
+static u32 cached_entries = 0;
+static u32 generation = 0;
+static u64 use_counter = 0;
+
+static void free_dir(cached_dir_t *dir) {
+    free(dir->path);
+    free(dir->entries);
+    free(dir->names);
+    free(dir);
+}
+
+static void remove_dir(u32 index) {
+    cached_dir_t *dir = dirs[index];
+    dirs[index] = NULL;
+    cached_entries -= dir->num_entries;
+    dir->cached = false;
+    if (!dir->users) free_dir(dir);
+}
+
+static s32 find_dir(const char *path) {
+    u32 i;
+    for (i = 0; i < DIRCACHE_MAX_DIRS; i++) {
+        if (dirs[i] && !strcasecmp(dirs[i]->path, path)) return i;
+    }
+    return -1;
+}
+
+/*
+    Writes the real path of the directory containing path into parent, and returns the entry name within it.
+    E.g. "carda:/foo/bar" -> "carda:/foo", "bar" and "carda:/foo" -> "carda:/", "foo".
+    Returns NULL if path has no parent.
+*/
+static const char *split_path(const char *path, char *parent) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || !slash[1]) return NULL;
+    u32 length = slash - path;
+    if (length && path[length - 1] == ':') length++;
+    memcpy(parent, path, length);
+    parent[length] = '\0';
+    return slash + 1;
+}
+
+static const char *sort_names;
+
+static int compare_entries(const void *a, const void *b) {
+    return strcasecmp(sort_names + ((cached_entry_t *)a)->name, sort_names + ((cached_entry_t *)b)->name);
+}
+
+static s32 find_entry(cached_dir_t *dir, const char *name) {
+    s32 low = 0, high = dir->num_entries - 1;
+    while (low <= high) {
+        s32 middle = (low + high) / 2;
+        s32 comparison = strcasecmp(name, dir->names + dir->entries[middle].name);
+        if (comparison == 0) return middle;
+        else if (comparison < 0) high = middle - 1;
+        else low = middle + 1;
+    }
+    return -1;
+}
+
+/*
+    Makes room for a directory of num_entries entries by evicting least-recently-used unpinned directories.
+    Returns the free slot, or -1 if there is no room.
+*/
+static s32 make_room(u32 num_entries) {
+    while (1) {
+        s32 free_slot = -1, victim = -1;
+        u32 i;
+        for (i = 0; i < DIRCACHE_MAX_DIRS; i++) {
+            if (!dirs[i]) {
+                if (free_slot < 0) free_slot = i;
+            } else if (!dirs[i]->users && (victim < 0 || dirs[i]->last_used < dirs[victim]->last_used)) {
+                victim = i;
+            }
+        }
+        if (free_slot >= 0 && cached_entries + num_entries <= DIRCACHE_MAX_ENTRIES) return free_slot;
+        if (victim < 0) return -1;
+        remove_dir(victim);
+    }
+}
+
+static void insert_dir(cached_dir_t *dir) {
+    if (dir->generation != generation || dir->num_entries > DIRCACHE_MAX_ENTRIES) return;
+    s32 existing = find_dir(dir->path);
+    if (existing >= 0) remove_dir(existing);
+    s32 slot = make_room(dir->num_entries);
+    if (slot < 0) return;
+    sort_names = dir->names;
+    qsort(dir->entries, dir->num_entries, sizeof(cached_entry_t), compare_entries);
+    dirs[slot] = dir;
+    cached_entries += dir->num_entries;
+    dir->cached = true;
+    dir->last_used = ++use_counter;
+}
+
+/*
+    Returns the cached contents of the directory at path, pinned until dircache_close, or NULL on a miss.
+*/
+cached_dir_t *dircache_open(const char *path) {
+    s32 index = find_dir(path);
+    if (index < 0) return NULL;
+    cached_dir_t *dir = dirs[index];
+    dir->users++;
+    dir->last_used = ++use_counter;
+    return dir;
+}
+
+/*
+    Starts recording the contents of the directory at path as it is read from the device.
+    Once every entry has been added, dircache_close inserts it into the cache,
+    unless anything was invalidated in the meantime.  Returns NULL if out of memory.
+*/
+cached_dir_t *dircache_begin(const char *path) {
+    cached_dir_t *dir = malloc(sizeof(cached_dir_t));
+    if (!dir) return NULL;
+    memset(dir, 0, sizeof(cached_dir_t));
+    if (!(dir->path = strdup(path))) {
+        free(dir);
+        return NULL;
+    }
+    dir->users = 1;
+    dir->generation = generation;
+    dir->building = true;
+    return dir;
+}
+
+/*
+    Returns false if the directory has become too large to cache, after which it is abandoned.
+*/
+bool dircache_add(cached_dir_t *dir, struct dirent *dirent) {
+    if (dir->num_entries == DIRCACHE_MAX_ENTRIES) return false;
+    u32 name_length = strlen(dirent->d_name) + 1;
+    if (dir->num_entries == dir->entries_capacity) {
+        u32 capacity = dir->entries_capacity ? dir->entries_capacity * 2 : 64;
+        cached_entry_t *entries = realloc(dir->entries, capacity * sizeof(cached_entry_t));
+        if (!entries) return false;
+        dir->entries = entries;
+        dir->entries_capacity = capacity;
+    }
+    if (dir->names_length + name_length > dir->names_capacity) {
+        u32 capacity = dir->names_capacity ? dir->names_capacity : 1024;
+        while (capacity < dir->names_length + name_length) capacity *= 2;
+        char *names = realloc(dir->names, capacity);
+        if (!names) return false;
+        dir->names = names;
+        dir->names_capacity = capacity;
+    }
+    cached_entry_t *entry = dir->entries + dir->num_entries++;
+    entry->name = dir->names_length;
+    entry->type = dirent->d_type;
+    entry->stat_valid = false;
+    memcpy(dir->names + dir->names_length, dirent->d_name, name_length);
+    dir->names_length += name_length;
+    return true;
+}
+
+/*
+    Releases a directory returned by dircache_open or dircache_begin.
+    complete says whether a directory being built has had all of its entries added.
+*/
+void dircache_close(cached_dir_t *dir, bool complete) {
+    dir->users--;
+    if (dir->building && complete) insert_dir(dir);
+    dir->building = false;
+    if (!dir->cached && !dir->users) free_dir(dir);
+}
+
+bool dircache_entry(cached_dir_t *dir, u32 index, struct dirent *dirent) {
+    if (index >= dir->num_entries) return false;
+    cached_entry_t *entry = dir->entries + index;
+    strcpy(dirent->d_name, dir->names + entry->name);
+    dirent->d_type = entry->type;
+    return true;
+}
+
+bool dircache_entry_stat(cached_dir_t *dir, u32 index, struct stat *st) {
+    if (index >= dir->num_entries || !dir->entries[index].stat_valid) return false;
+    memcpy(st, &dir->entries[index].st, sizeof(struct stat));
+    return true;
+}
+
+void dircache_set_entry_stat(cached_dir_t *dir, u32 index, struct stat *st) {
+    if (index >= dir->num_entries) return;
+    memcpy(&dir->entries[index].st, st, sizeof(struct stat));
+    dir->entries[index].stat_valid = true;
+}
+
+/*
+    Looks path up in the cached contents of its parent directory.
+*/
+bool dircache_stat(const char *path, struct stat *st) {
+    char parent[PATH_MAX];
+    const char *name = split_path(path, parent);
+    if (!name) return false;
+    s32 index = find_dir(parent);
+    if (index < 0) return false;
+    cached_dir_t *dir = dirs[index];
+    s32 entry = find_entry(dir, name);
+    if (entry < 0 || !dircache_entry_stat(dir, entry, st)) return false;
+    dir->last_used = ++use_counter;
+    return true;
+}
+
+/*
+    Forgets the directory containing path, and path itself and everything below it should it be a directory.
+*/
+void dircache_invalidate(const char *path) {
+    generation++;
+    char parent[PATH_MAX];
+    if (split_path(path, parent)) {
+        s32 index = find_dir(parent);
+        if (index >= 0) remove_dir(index);
+    }
+    u32 length = strlen(path);
+    u32 i;
+    for (i = 0; i < DIRCACHE_MAX_DIRS; i++) {
+        if (dirs[i] && !strncasecmp(dirs[i]->path, path, length) && (!dirs[i]->path[length] || dirs[i]->path[length] == '/')) {
+            remove_dir(i);
+        }
+    }
+}
+
+/*
+    Forgets every directory whose path begins with prefix, e.g. when a device is unmounted.
+*/
+void dircache_flush(const char *prefix) {
+    generation++;
+    u32 length = strlen(prefix);
+    u32 i;
+    for (i = 0; i < DIRCACHE_MAX_DIRS; i++) {
+        if (dirs[i] && !strncasecmp(dirs[i]->path, prefix, length)) remove_dir(i);
+    }
+}
+
+/*
+    Writes a summary line and then one fact line per cached directory, for /ftpii/dircache.
+*/
+s32 dircache_write_state(stats_line_writer write, void *arg) {
+    char line[PATH_MAX + 80];
+    u32 num_dirs = 0;
+    u32 i;
+    for (i = 0; i < DIRCACHE_MAX_DIRS; i++) {
+        if (dirs[i]) num_dirs++;
+    }
+    snprintf(line, sizeof(line), "dirs=%u;dirs.max=%u;entries=%u;entries.max=%u;generation=%u;",
+        num_dirs, DIRCACHE_MAX_DIRS, cached_entries, DIRCACHE_MAX_ENTRIES, generation);
+    s32 result = write(arg, line);
+    for (i = 0; i < DIRCACHE_MAX_DIRS && result >= 0; i++) {
+        if (!dirs[i]) continue;
+        snprintf(line, sizeof(line), "entries=%u;users=%u;last_used=%llu;path=%s;",
+            dirs[i]->num_entries, dirs[i]->users, dirs[i]->last_used, dirs[i]->path);
+        result = write(arg, line);
+    }
+    return result;
+}
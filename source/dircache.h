@@ -0,0 +1,57 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _DIRCACHE_H_
+#define _DIRCACHE_H_
+
+#include <gctypes.h>
+#include <sys/dirent.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+typedef struct cached_dir_struct cached_dir_t;
+
+cached_dir_t *dircache_open(const char *path);
+
+cached_dir_t *dircache_begin(const char *path);
+
+bool dircache_add(cached_dir_t *dir, struct dirent *dirent);
+
+void dircache_close(cached_dir_t *dir, bool complete);
+
+bool dircache_entry(cached_dir_t *dir, u32 index, struct dirent *dirent);
+
+bool dircache_entry_stat(cached_dir_t *dir, u32 index, struct stat *st);
+
+void dircache_set_entry_stat(cached_dir_t *dir, u32 index, struct stat *st);
+
+bool dircache_stat(const char *path, struct stat *st);
+
+void dircache_invalidate(const char *path);
+
+void dircache_flush(const char *prefix);
+
+s32 dircache_write_state(stats_line_writer write, void *arg);
+
+#endif /* _DIRCACHE_H_ */
@@ -21,6 +21,8 @@ misrepresented as being the original software.
 3.This notice may not be removed or altered from any source distribution.
 
 */
+#include <ctype.h>
+#include <errno.h>
 #include <fat.h>
 #include <malloc.h>
 #include <ogc/lwp_watchdog.h>
@@ -28,14 +30,34 @@ misrepresented as being the original software.
 #include <ogc/system.h>
 #include <sdcard/gcsd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/dir.h>
 #include <unistd.h>
 
+#include "blockcache.h"
+#include "dircache.h"
 #include "fs.h"
+#include "log.h"
+#include "shared_file.h"
+#include "transfer.h"
 
-#define CACHE_PAGES 8
-#define CACHE_SECTORS_PER_PAGE 64
+/*
+    libfat keeps only the few pages it needs to batch FAT and directory updates; reads are cached by
+    each partition's sector cache underneath it, where they can be counted.  Metadata arrives in reads
+    of one libfat page, which browsing wants many small pages for; file data arrives a transfer buffer
+    at a time, which a few large pages read ahead of.
+*/
+#define LIBFAT_CACHE_PAGES 4
+#define LIBFAT_CACHE_SECTORS_PER_PAGE 8
+#define BROWSE_SECTORS_PER_PAGE LIBFAT_CACHE_SECTORS_PER_PAGE
+#define BALANCED_SECTORS_PER_PAGE 32
+#define STREAM_SECTORS_PER_PAGE 128
+#define MAX_SECTORS_PER_PAGE 256
+#define STREAM_MEAN_READ_SECTORS 32
+
+static const char *CACHE_PROFILE_NAMES[] = { "auto", "browse", "stream", "fixed" };
+static u32 cache_memory_budget = 0;
 
 VIRTUAL_PARTITION VIRTUAL_PARTITIONS[] = {
     { "SD Gecko A", "/carda", "carda", "carda:/", false, false, &__io_gcsda },
@@ -46,6 +68,85 @@ const u32 MAX_VIRTUAL_PARTITIONS = (sizeof(VIRTUAL_PARTITIONS) / sizeof(VIRTUAL_
 VIRTUAL_PARTITION *PA_GCSDA   = VIRTUAL_PARTITIONS + 0;
 VIRTUAL_PARTITION *PA_GCSDB   = VIRTUAL_PARTITIONS + 1;
 
+/*
+    libfat is mounted on a copy of each device's DISC_INTERFACE whose sector reads and writes go through
+    the partition's sector cache, and are counted into its stats when they reach the device.
+    The interface passes no context, so each partition needs its own pair of functions.
+*/
+static DISC_INTERFACE counted_discs[2];
+
+static bool counted_read(void *arg, sec_t sector, sec_t count, void *buffer) {
+    VIRTUAL_PARTITION *partition = arg;
+    u64 start = gettime();
+    bool success = partition->disc->readSectors(sector, count, buffer);
+    partition->stats.read_ticks += diff_ticks(start, gettime());
+    partition->stats.read_requests++;
+    if (success) partition->stats.sectors_read += count;
+    else partition->stats.read_errors++;
+    return success;
+}
+
+static bool counted_write(void *arg, sec_t sector, sec_t count, const void *buffer) {
+    VIRTUAL_PARTITION *partition = arg;
+    u64 start = gettime();
+    bool success = partition->disc->writeSectors(sector, count, buffer);
+    partition->stats.write_ticks += diff_ticks(start, gettime());
+    partition->stats.write_requests++;
+    if (success) partition->stats.sectors_written += count;
+    else partition->stats.write_errors++;
+    return success;
+}
+
+#define COUNTED_DISC_FUNCTIONS(index) \
+    static bool read_sectors_##index(sec_t sector, sec_t count, void *buffer) { \
+        return sector_cache_read(&VIRTUAL_PARTITIONS[index].cache, sector, count, buffer); \
+    } \
+    static bool write_sectors_##index(sec_t sector, sec_t count, const void *buffer) { \
+        return sector_cache_write(&VIRTUAL_PARTITIONS[index].cache, sector, count, buffer); \
+    }
+
+COUNTED_DISC_FUNCTIONS(0)
+COUNTED_DISC_FUNCTIONS(1)
+
+static const DISC_INTERFACE *counted_disc(VIRTUAL_PARTITION *partition) {
+    static bool (*const reads[])(sec_t, sec_t, void *) = { read_sectors_0, read_sectors_1 };
+    static bool (*const writes[])(sec_t, sec_t, const void *) = { write_sectors_0, write_sectors_1 };
+    u32 index = partition - VIRTUAL_PARTITIONS;
+    DISC_INTERFACE *disc = counted_discs + index;
+    *disc = *partition->disc;
+    disc->readSectors = reads[index];
+    disc->writeSectors = writes[index];
+    return disc;
+}
+
+/*
+    Gives the partition its share of the cache memory budget, in pages shaped by its cache profile.
+    In auto, a partition that has mostly been read a transfer buffer at a time gets the stream shape.
+*/
+static cache_geometry_t choose_geometry(VIRTUAL_PARTITION *partition) {
+    if (partition->cache_profile == CACHE_FIXED) return partition->fixed_geometry;
+    cache_profile_t profile = partition->cache_profile;
+    cache_stats_t *stats = &partition->cache.stats;
+    if (profile == CACHE_AUTO && stats->requests) {
+        profile = stats->requested_sectors / stats->requests >= STREAM_MEAN_READ_SECTORS ? CACHE_STREAM : CACHE_BROWSE;
+    }
+    u32 sectors_per_page = BALANCED_SECTORS_PER_PAGE;
+    if (profile == CACHE_BROWSE) sectors_per_page = BROWSE_SECTORS_PER_PAGE;
+    else if (profile == CACHE_STREAM) sectors_per_page = STREAM_SECTORS_PER_PAGE;
+    cache_geometry_t geometry = { cache_memory_budget / MAX_VIRTUAL_PARTITIONS / (sectors_per_page * SECTOR_SIZE), sectors_per_page };
+    return geometry;
+}
+
+static void start_cache(VIRTUAL_PARTITION *partition) {
+    sector_cache_t *cache = &partition->cache;
+    cache->read = counted_read;
+    cache->write = counted_write;
+    cache->arg = partition;
+    if (!sector_cache_init(cache, choose_geometry(partition))) {
+        log_warning(LOG_FS, "Not enough memory for the sector cache of %s, reading it uncached.", partition->name);
+    }
+}
+
 static VIRTUAL_PARTITION *to_virtual_partition(const char *virtual_prefix) {
     u32 i;
     for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++)
@@ -92,8 +193,11 @@ bool mount(VIRTUAL_PARTITION *partition) {
         bool retry_gecko = true;
         gecko_retry:
         if (partition->disc->shutdown() & partition->disc->startup()) {
-            if (fatMount(partition->mount_point, partition->disc, 0, CACHE_PAGES, CACHE_SECTORS_PER_PAGE)) {
+            start_cache(partition);
+            if (fatMount(partition->mount_point, counted_disc(partition), 0, LIBFAT_CACHE_PAGES, LIBFAT_CACHE_SECTORS_PER_PAGE)) {
                 success = true;
+            } else {
+                sector_cache_free(&partition->cache);
             }
         } else if (is_gecko(partition) && retry_gecko) {
             retry_gecko = false;
@@ -111,24 +215,91 @@ bool mount_virtual(const char *dir) {
     return mount(to_virtual_partition(dir));
 }
 
-bool unmount(VIRTUAL_PARTITION *partition) {
-    if (!partition || !mounted(partition)) return false;
+/*
+    Whether transfer threads still hold files on partition, which unmounting would pull out from under them.
+*/
+static bool files_open(VIRTUAL_PARTITION *partition) {
+    return transfers_open_under(partition->prefix) || shared_files_open_under(partition->prefix);
+}
 
+static bool unmount_partition(VIRTUAL_PARTITION *partition) {
     printf("Unmounting %s...", partition->name);
     bool success = false;
     if (is_fat(partition)) {
         fatUnmount(partition->prefix);
+        partition->cluster_size = 0;
+        sector_cache_free(&partition->cache);
         success = true;
     }
+    dircache_flush(partition->prefix);
+    blockcache_flush(partition->prefix);
+    shared_file_flush(partition->prefix);
     printf(success ? "succeeded.\n" : "failed.\n");
 
     return success;
 }
 
+/*
+    Returns false with errno EBUSY while transfers still have files open on partition.
+*/
+bool unmount(VIRTUAL_PARTITION *partition) {
+    errno = EINVAL;
+    if (!partition || !mounted(partition)) return false;
+    if (files_open(partition)) {
+        errno = EBUSY;
+        return false;
+    }
+    return unmount_partition(partition);
+}
+
+/*
+    For a device that is going away regardless: fails the transfers on it first, once their threads are out of libfat.
+*/
+static bool force_unmount(VIRTUAL_PARTITION *partition) {
+    if (!partition || !mounted(partition)) return false;
+    abort_transfers_under(partition->prefix);
+    return unmount_partition(partition);
+}
+
 bool unmount_virtual(const char *dir) {
     return unmount(to_virtual_partition(dir));
 }
 
+/*
+    setting is "auto", "browse", "stream", "off" or a geometry "<pages>x<sectors per page>" that fits the cache memory budget.
+    A mounted partition is remounted to apply it; otherwise it applies at the next mount.
+    Returns false with errno EBUSY if the partition can't be remounted yet, or EINVAL if the setting is bad.
+*/
+bool retune_cache(const char *dir, const char *setting) {
+    errno = EINVAL;
+    VIRTUAL_PARTITION *partition = to_virtual_partition(dir);
+    if (!partition || !is_fat(partition)) return false;
+    cache_profile_t profile = CACHE_FIXED;
+    cache_geometry_t geometry = { 0, 0 };
+    if (!strcasecmp("auto", setting)) profile = CACHE_AUTO;
+    else if (!strcasecmp("browse", setting)) profile = CACHE_BROWSE;
+    else if (!strcasecmp("stream", setting)) profile = CACHE_STREAM;
+    else if (strcasecmp("off", setting)) {
+        char *end;
+        geometry.pages = strtoul(setting, &end, 10);
+        if (end == setting || tolower((u8)*end) != 'x') return false;
+        const char *sectors = end + 1;
+        geometry.sectors_per_page = strtoul(sectors, &end, 10);
+        if (end == sectors || *end || !geometry.pages) return false;
+        if (!geometry.sectors_per_page || geometry.sectors_per_page % LIBFAT_CACHE_SECTORS_PER_PAGE) return false;
+        if (geometry.sectors_per_page > MAX_SECTORS_PER_PAGE) return false;
+        if ((u64)geometry.pages * geometry.sectors_per_page * SECTOR_SIZE > cache_memory_budget) return false;
+    }
+    if (mounted(partition) && files_open(partition)) {
+        errno = EBUSY;
+        return false;
+    }
+    partition->cache_profile = profile;
+    partition->fixed_geometry = geometry;
+    if (!mounted(partition)) return true;
+    return unmount(partition) && mount(partition);
+}
+
 static u64 device_check_timer = 0;
 
 void check_removable_devices(u64 now) {
@@ -148,7 +319,7 @@ void check_removable_devices(u64 now) {
                 }
             } else if (!partition->inserted && mounted(partition)) {
                 printf("Device removed; ");
-                unmount(partition);
+                force_unmount(partition);
             }
         }
     }
@@ -156,6 +327,14 @@ void check_removable_devices(u64 now) {
     device_check_timer = gettime() + secs_to_ticks(2);
 }
 
+/*
+    Returns the earliest time at which check_mount_timer or check_removable_devices has work to do.
+*/
+u64 next_fs_timer() {
+    if (mount_timer && mount_timer < device_check_timer) return mount_timer;
+    return device_check_timer;
+}
+
 void process_remount_event() {
     if (mountstate == MOUNTSTATE_START || mountstate == MOUNTSTATE_SELECTDEVICE) {
         mountstate = MOUNTSTATE_SELECTDEVICE;
@@ -180,7 +359,7 @@ void process_device_select_event(u32 pressed) {
         else if (pressed & PAD_BUTTON_DOWN) mount_partition = PA_GCSDB;
         if (mount_partition) {
             mountstate = MOUNTSTATE_WAITFORDEVICE;
-            if (is_fat(mount_partition)) unmount(mount_partition);
+            if (is_fat(mount_partition)) force_unmount(mount_partition);
             printf("To continue after changing the device hold B on controller #1 or wait 30 seconds.\n");
             mount_timer = gettime() + secs_to_ticks(30);
         }
@@ -191,7 +370,28 @@ void check_mount_timer(u64 now) {
     if (mount_timer && now > mount_timer) process_remount_event();
 }
 
-void initialise_fs() {
+/*
+    Writes one fact line per virtual partition, for /ftpii/mounts.
+*/
+s32 write_mounts(stats_line_writer write, void *arg) {
+    s32 result = 0;
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS && result >= 0; i++) {
+        VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + i;
+        char line[192];
+        snprintf(line, sizeof(line), "alias=%s;name=%s;inserted=%u;mounted=%u;failed=%u;cache.profile=%s;cache.pages=%u;cache.sectors_per_page=%u;",
+            partition->alias, partition->name, partition->inserted, mounted(partition), partition->geckofail,
+            CACHE_PROFILE_NAMES[partition->cache_profile], partition->cache.geometry.pages, partition->cache.geometry.sectors_per_page);
+        result = write(arg, line);
+    }
+    return result;
+}
+
+/*
+    memory_budget bytes are shared between the partitions' sector caches.
+*/
+void initialise_fs(u32 memory_budget) {
+    cache_memory_budget = memory_budget;
 }
 
 /*
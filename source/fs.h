@@ -26,6 +26,15 @@ misrepresented as being the original software.
 
 #include <ogc/disc_io.h>
 
+#include "sector_cache.h"
+#include "stats.h"
+
+/*
+    How a partition's sector cache is shaped when it is mounted: CACHE_AUTO picks browse or stream
+    from the reads seen so far, CACHE_FIXED uses the geometry given to retune_cache.
+*/
+typedef enum { CACHE_AUTO, CACHE_BROWSE, CACHE_STREAM, CACHE_FIXED } cache_profile_t;
+
 typedef struct {
     const char *name;
     const char *alias;
@@ -34,6 +43,13 @@ typedef struct {
     bool inserted;
     bool geckofail;
     const DISC_INTERFACE *disc;
+    device_stats_t stats;
+    cache_profile_t cache_profile;
+    cache_geometry_t fixed_geometry;
+    sector_cache_t cache;
+    u64 reserved; // bytes set aside by ALLO for uploads in progress
+    u32 cluster_size; // 0 until looked up
+    u64 free_space; // as looked up with cluster_size, less what uploads have since taken and plus what deletes freed
 } VIRTUAL_PARTITION;
 
 extern VIRTUAL_PARTITION VIRTUAL_PARTITIONS[2];
@@ -41,7 +57,7 @@ extern const u32 MAX_VIRTUAL_PARTITIONS;
 extern VIRTUAL_PARTITION *PA_GCSDA;
 extern VIRTUAL_PARTITION *PA_GCSDB;
 
-void initialise_fs();
+void initialise_fs(u32 memory_budget);
 
 bool mounted(VIRTUAL_PARTITION *partition);
 
@@ -53,6 +69,8 @@ bool mount_virtual(const char *dir);
 
 bool unmount_virtual(const char *dir);
 
+bool retune_cache(const char *dir, const char *setting);
+
 void check_removable_devices(u64 now);
 
 void process_remount_event();
@@ -61,6 +79,10 @@ void process_device_select_event(u32 pressed);
 
 void check_mount_timer(u64 now);
 
+u64 next_fs_timer();
+
+s32 write_mounts(stats_line_writer write, void *arg);
+
 char *dirname(char *path);
 
 char *basename(char *path);
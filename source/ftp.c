@@ -23,6 +23,7 @@ misrepresented as being the original software.
 3.This notice may not be removed or altered from any source distribution.
 
 */
+#include <ctype.h>
 #include <errno.h>
 #include <malloc.h>
 #include <network.h>
@@ -31,41 +32,70 @@ misrepresented as being the original software.
 #include <string.h>
 #include <sys/dir.h>
 #include <sys/fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ftp.h"
 #include "fs.h"
+#include "intern.h"
+#include "journal.h"
+#include "log.h"
 #include "net.h"
+#include "passive.h"
+#include "procfs.h"
 #include "reset.h"
+#include "stats.h"
+#include "trace.h"
+#include "transfer.h"
 #include "vrt.h"
 
 #define FTP_BUFFER_SIZE 1024
-#define MAX_CLIENTS 5
+/*
+    lwIP's socket table in libogc's libbba build has NET_SOCKETS entries (MEMP_NUM_NETCONN in its lwipopts.h).
+    The server's listening socket, the wakeup socket, the spare passive sockets and a peer being turned away with 421
+    take one each, and a session can hold three: its control connection, its passive listening socket and its data connection.
+*/
+#define NET_SOCKETS 32
+#define MAX_CLIENT_SLOTS ((NET_SOCKETS - 3 - PASSIVE_SPARES) / 3)
+#define DATA_SEGMENT_SIZE 1460
+#define DATA_FLUSH_SIZE (8 * DATA_SEGMENT_SIZE)
+#define LISTING_ENTRIES_PER_CALL 64
+#define LISTING_LINE_MAX (PATH_MAX + 80)
+#define BUSY_POLL_INTERVAL_MS 2 // only without a wakeup socket
 
 static const u16 SRC_PORT = 20;
 static const s32 EQUIT = 696969;
 static const char *CRLF = "\r\n";
 static const u32 CRLF_LENGTH = 2;
+static const char *TOO_MANY_CLIENTS_REPLY = "421 Too many users, try again later.\r\n";
 
-static u8 num_clients = 0;
-static u16 passive_port = 1024;
+static u32 num_clients = 0;
+static u32 max_clients = 0;
 static char *password = NULL;
 
-typedef s32 (*data_connection_callback)(s32 data_socket, void *arg);
+typedef s32 (*data_connection_callback)(s32 data_socket, output_queue_t *output, void *arg);
 
 struct client_struct {
+    bool in_use;
     s32 socket;
     char representation_type;
     s32 passive_socket;
+    u16 passive_port;
+    bool epsv_all;
     s32 data_socket;
-    char cwd[PATH_MAX];
-    char pending_rename[PATH_MAX];
+    const char *cwd; // interned
+    const char *pending_rename; // interned, NULL if there is none
     off_t restart_marker;
+    u64 allocation; // announced by ALLO for the next STOR or APPE, 0 if there is none
     struct sockaddr_in address;
     bool authenticated;
     char buf[FTP_BUFFER_SIZE];
     s32 offset;
+    output_queue_t replies;
+    output_queue_t data_output;
     bool data_connection_connected;
+    bool data_connection_receiving;
+    bool data_connection_busy;
     data_connection_callback data_callback;
     void *data_connection_callback_arg;
     void (*data_connection_cleanup)(void *arg);
@@ -74,7 +104,11 @@ struct client_struct {
 
 typedef struct client_struct client_t;
 
-static client_t *clients[MAX_CLIENTS] = { NULL };
+/*
+    Session slots are allocated once, at startup, so that clients coming and going never fragment the heap.
+*/
+static client_t *client_slots = NULL;
+static const char *root_cwd = NULL;
 
 void set_ftp_password(char *new_password) {
     if (password) free(password);
@@ -92,62 +126,70 @@ static bool compare_ftp_password(char *password_attempt) {
 }
 
 /*
-    TODO: support multi-line reply
+    Queues one line of a reply.  separator is ' ' for the final line and '-' for the first line of a multi-line reply.
+    A code of 0 queues a continuation line, which is indented by a space instead.
 */
-static s32 write_reply(client_t *client, u16 code, char *msg) {
+static s32 queue_reply_line(client_t *client, u16 code, char separator, const char *msg) {
     u32 msglen = 4 + strlen(msg) + CRLF_LENGTH;
-    char msgbuf[msglen + 1];
+    char *msgbuf = queue_reserve(&client->replies, msglen + 1);
     if (msgbuf == NULL) return -ENOMEM;
-    sprintf(msgbuf, "%u %s\r\n", code, msg);
-    printf("Wrote reply: %s", msgbuf);
-    return send_exact(client->socket, msgbuf, msglen);
+    if (code) {
+        sprintf(msgbuf, "%u%c%s\r\n", code, separator, msg);
+    } else {
+        sprintf(msgbuf, " %s\r\n", msg);
+    }
+    u32 length = strlen(msgbuf);
+    log_debug(LOG_FTP, "Wrote reply: %.*s", (int)(length - CRLF_LENGTH), msgbuf);
+    queue_commit(&client->replies, length);
+    return 0;
+}
+
+static s32 flush_replies(client_t *client) {
+    s32 result = queue_flush(client->socket, &client->replies);
+    return result == -EAGAIN ? 0 : result;
+}
+
+/*
+    Replies are only queued here.  Everything queued while handling one batch of commands
+    goes out together when the batch is done, or once the control socket is writable again.
+*/
+static s32 write_reply(client_t *client, u16 code, char *msg) {
+    return queue_reply_line(client, code, ' ', msg);
+}
+
+/*
+    Writes a multi-line reply: "code-first", then each of lines indented by a space, then "code last".
+    lines is NULL-terminated.
+*/
+static s32 write_multiline_reply(client_t *client, u16 code, char *first, const char **lines, char *last) {
+    s32 result = queue_reply_line(client, code, '-', first);
+    for (; result >= 0 && *lines; lines++) {
+        result = queue_reply_line(client, 0, ' ', *lines);
+    }
+    if (result >= 0) result = queue_reply_line(client, code, ' ', last);
+    return result;
 }
 
 static void close_passive_socket(client_t *client) {
     if (client->passive_socket >= 0) {
-        net_close_blocking(client->passive_socket);
+        release_passive_socket(client->passive_socket, client->passive_port);
         client->passive_socket = -1;
     }
 }
 
 /*
-    result must be able to hold up to maxsplit+1 null-terminated strings of length strlen(s)
-    returns the number of strings stored in the result array (up to maxsplit+1)
+    Splits the first space-separated word off s in place, leaving s holding just that word.
+    Returns the rest of the line with leading and trailing spaces removed, which is empty if there is none.
 */
-static u32 split(char *s, char sep, u32 maxsplit, char *result[]) {
-    u32 num_results = 0;
-    u32 result_pos = 0;
-    u32 trim_pos = 0;
-    bool in_word = false;
-    for (; *s; s++) {
-        if (*s == sep) {
-            if (num_results <= maxsplit) {
-                in_word = false;
-                continue;
-            } else if (!trim_pos) {
-                trim_pos = result_pos;
-            }
-        } else if (trim_pos) {
-            trim_pos = 0;
-        }
-        if (!in_word) {
-            in_word = true;
-            if (num_results <= maxsplit) {
-                num_results++;
-                result_pos = 0;
-            }
-        }
-        result[num_results - 1][result_pos++] = *s;
-        result[num_results - 1][result_pos] = '\0';
-    }
-    if (trim_pos) {
-        result[num_results - 1][trim_pos] = '\0';
-    }
-    u32 i = num_results;
-    for (i = num_results; i <= maxsplit; i++) {
-        result[i][0] = '\0';
-    }
-    return num_results;
+static char *split_word(char *s) {
+    char *rest = strchr(s, ' ');
+    if (!rest) return s + strlen(s);
+    *rest++ = '\0';
+    while (*rest == ' ') rest++;
+    char *end = rest + strlen(rest);
+    while (end > rest && end[-1] == ' ') end--;
+    *end = '\0';
+    return rest;
 }
 
 static s32 ftp_USER(client_t *client, char *username) {
@@ -165,14 +207,15 @@ static s32 ftp_PASS(client_t *client, char *password_attempt) {
 
 static s32 ftp_REIN(client_t *client, char *rest) {
     close_passive_socket(client);
-    strcpy(client->cwd, "/");
+    release_string(client->cwd);
+    client->cwd = retain_string(root_cwd);
+    client->epsv_all = false;
     client->representation_type = 'A';
     client->authenticated = false;
     return write_reply(client, 220, "Service ready for new user.");
 }
 
 static s32 ftp_QUIT(client_t *client, char *rest) {
-    // TODO: dont quit if xfer in progress
     s32 result = write_reply(client, 221, "Service closing control connection.");
     return result < 0 ? result : -EQUIT;
 }
@@ -182,13 +225,12 @@ static s32 ftp_SYST(client_t *client, char *rest) {
 }
 
 static s32 ftp_TYPE(client_t *client, char *rest) {
-    char representation_type[FTP_BUFFER_SIZE], param[FTP_BUFFER_SIZE];
-    char *args[] = { representation_type, param };
-    u32 num_args = split(rest, ' ', 1, args);
-    if (num_args == 0) {
+    char *representation_type = rest;
+    char *param = split_word(rest);
+    if (!*representation_type) {
         return write_reply(client, 501, "Syntax error in parameters.");
     } else if ((!strcasecmp("A", representation_type) && (!*param || !strcasecmp("N", param))) ||
-               (!strcasecmp("I", representation_type) && num_args == 1)) {
+               (!strcasecmp("I", representation_type) && !*param)) {
         client->representation_type = *representation_type;
     } else {
         return write_reply(client, 501, "Syntax error in parameters.");
@@ -213,24 +255,27 @@ static s32 ftp_PWD(client_t *client, char *rest) {
     return write_reply(client, 257, msg);
 }
 
-static s32 ftp_CWD(client_t *client, char *path) {
-    s32 result;
-    if (!vrt_chdir(client->cwd, path)) {
-        result = write_reply(client, 250, "CWD command successful.");
-    } else  {
-        result = write_reply(client, 550, strerror(errno));
+static s32 change_directory(client_t *client, char *path, char *msg) {
+    char cwd[PATH_MAX];
+    strcpy(cwd, client->cwd);
+    if (vrt_chdir(cwd, path)) {
+        return write_reply(client, 550, strerror(errno));
     }
-    return result;
+    const char *interned_cwd = intern_string(cwd);
+    if (!interned_cwd) {
+        return write_reply(client, 550, strerror(ENOMEM));
+    }
+    release_string(client->cwd);
+    client->cwd = interned_cwd;
+    return write_reply(client, 250, msg);
+}
+
+static s32 ftp_CWD(client_t *client, char *path) {
+    return change_directory(client, path, "CWD command successful.");
 }
 
 static s32 ftp_CDUP(client_t *client, char *rest) {
-    s32 result;
-    if (!vrt_chdir(client->cwd, "..")) {
-        result = write_reply(client, 250, "CDUP command successful.");
-    } else  {
-        result = write_reply(client, 550, strerror(errno));
-    }
-    return result;
+    return change_directory(client, "..", "CDUP command successful.");
 }
 
 static s32 ftp_DELE(client_t *client, char *path) {
@@ -259,12 +304,17 @@ static s32 ftp_MKD(client_t *client, char *path) {
 }
 
 static s32 ftp_RNFR(client_t *client, char *path) {
-    strcpy(client->pending_rename, path);
+    const char *pending_rename = intern_string(path);
+    if (!pending_rename) {
+        return write_reply(client, 550, strerror(ENOMEM));
+    }
+    release_string(client->pending_rename);
+    client->pending_rename = pending_rename;
     return write_reply(client, 350, "Ready for RNTO.");
 }
 
 static s32 ftp_RNTO(client_t *client, char *path) {
-    if (!*client->pending_rename) {
+    if (!client->pending_rename) {
         return write_reply(client, 503, "RNFR required first.");
     }
     s32 result;
@@ -273,53 +323,119 @@ static s32 ftp_RNTO(client_t *client, char *path) {
     } else {
         result = write_reply(client, 550, strerror(errno));
     }
-    *client->pending_rename = '\0';
+    release_string(client->pending_rename);
+    client->pending_rename = NULL;
     return result;
 }
 
+/*
+    The size of a file whose upload was cut off is what its journal says reached the card,
+    so that clients resuming from SIZE resume from there.
+*/
 static s32 ftp_SIZE(client_t *client, char *path) {
     struct stat st;
     if (!vrt_stat(client->cwd, path, &st)) {
-        char size_buf[12];
-        sprintf(size_buf, "%llu", st.st_size);
+        u64 size = st.st_size;
+        vrt_path_t resolved;
+        u64 committed;
+        if (!vrt_resolve(client->cwd, path, &resolved) && journal_length(resolved.real_path, &committed)) size = MIN(size, committed);
+        char size_buf[21];
+        sprintf(size_buf, "%llu", size);
         return write_reply(client, 213, size_buf);
     } else {
         return write_reply(client, 550, strerror(errno));
     }
 }
 
-static s32 ftp_PASV(client_t *client, char *rest) {
-    close_passive_socket(client);
-    client->passive_socket = net_socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-    if (client->passive_socket < 0) {
-        return write_reply(client, 520, "Unable to create listening socket.");
+static s32 ftp_MDTM(client_t *client, char *path) {
+    struct stat st;
+    if (!vrt_stat(client->cwd, path, &st)) {
+        if (S_ISDIR(st.st_mode)) return write_reply(client, 550, "Not a plain file.");
+        char timestamp[15];
+        strftime(timestamp, sizeof(timestamp), "%Y%m%d%H%M%S", gmtime(&st.st_mtime));
+        return write_reply(client, 213, timestamp);
+    } else {
+        return write_reply(client, 550, strerror(errno));
     }
-    set_blocking(client->passive_socket, false);
-    struct sockaddr_in bindAddress;
-    memset(&bindAddress, 0, sizeof(bindAddress));
-    bindAddress.sin_family = AF_INET;
-    bindAddress.sin_port = htons(passive_port++); // XXX: BUG: This will overflow eventually, with interesting results...
-    bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
-    s32 result;
-    if ((result = net_bind(client->passive_socket, (struct sockaddr *)&bindAddress, sizeof(bindAddress))) < 0) {
-        close_passive_socket(client);
-        return write_reply(client, 520, "Unable to bind listening socket.");
+}
+
+/*
+    Formats an RFC 3659 fact line, "type=...;size=...;modify=...; name", returning snprintf's result.
+    st may be NULL if the entry could not be stat'ed, in which case only the type is given.
+*/
+static s32 format_facts(char *line, size_t size, const char *type, struct stat *st, const char *name) {
+    if (st) {
+        char timestamp[15];
+        strftime(timestamp, sizeof(timestamp), "%Y%m%d%H%M%S", gmtime(&st->st_mtime));
+        return snprintf(line, size, "type=%s;size=%llu;modify=%s; %s", type, (u64)st->st_size, timestamp, name);
+    } else {
+        return snprintf(line, size, "type=%s; %s", type, name);
     }
-    if ((result = net_listen(client->passive_socket, 1)) < 0) {
-        close_passive_socket(client);
-        return write_reply(client, 520, "Unable to listen on socket.");
+}
+
+static s32 ftp_MLST(client_t *client, char *path) {
+    if (!*path) {
+        path = ".";
+    }
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    if (vrt_stat(client->cwd, path, &st)) {
+        return write_reply(client, 550, strerror(errno));
+    }
+    char line[LISTING_LINE_MAX];
+    format_facts(line, sizeof(line), S_ISDIR(st.st_mode) ? "dir" : "file", &st, path);
+    const char *lines[] = { line, NULL };
+    return write_multiline_reply(client, 250, "Listing", lines, "End");
+}
+
+/*
+    Switches the client to a listening socket from the passive port pool, returning its port or a negative error.
+*/
+static s32 enter_passive_mode(client_t *client) {
+    close_passive_socket(client);
+    u16 port;
+    s32 result = acquire_passive_socket(&port);
+    if (result < 0) return result;
+    client->passive_socket = result;
+    client->passive_port = port;
+    log_debug(LOG_DATA, "Listening for data connections on port %u...", port);
+    return port;
+}
+
+static s32 ftp_PASV(client_t *client, char *rest) {
+    if (client->epsv_all) {
+        return write_reply(client, 503, "PASV not allowed after EPSV ALL.");
+    }
+    s32 port = enter_passive_mode(client);
+    if (port < 0) {
+        return write_reply(client, 520, "Unable to listen on a passive port.");
     }
     char reply[49];
-    u16 port = bindAddress.sin_port;
-    u32 ip = net_gethostip();
-    struct in_addr addr;
-    addr.s_addr = ip;
-    printf("Listening for data connections at %s:%u...\n", inet_ntoa(addr), port);
+    u32 ip = ntohl(net_gethostip());
     sprintf(reply, "Entering Passive Mode (%u,%u,%u,%u,%u,%u).", (ip >> 24) & 0xff, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, (port >> 8) & 0xff, port & 0xff);
     return write_reply(client, 227, reply);
 }
 
+static s32 ftp_EPSV(client_t *client, char *protocol) {
+    if (!strcasecmp("ALL", protocol)) {
+        client->epsv_all = true;
+        return write_reply(client, 200, "EPSV ALL command successful.");
+    } else if (*protocol && strcmp("1", protocol)) {
+        return write_reply(client, 522, "Network protocol not supported, use (1)");
+    }
+    s32 port = enter_passive_mode(client);
+    if (port < 0) {
+        return write_reply(client, 520, "Unable to listen on a passive port.");
+    }
+    char reply[48];
+    sprintf(reply, "Entering Extended Passive Mode (|||%u|).", port);
+    return write_reply(client, 229, reply);
+}
+
 static s32 ftp_PORT(client_t *client, char *portspec) {
+    if (client->epsv_all) {
+        return write_reply(client, 503, "PORT not allowed after EPSV ALL.");
+    }
     u32 h1, h2, h3, h4, p1, p2;
     if (sscanf(portspec, "%3u,%3u,%3u,%3u,%3u,%3u", &h1, &h2, &h3, &h4, &p1, &p2) < 6) {
         return write_reply(client, 501, "Syntax error in parameters.");
@@ -334,7 +450,7 @@ static s32 ftp_PORT(client_t *client, char *portspec) {
     u16 port = ((p1 &0xff) << 8) | (p2 & 0xff);
     client->address.sin_addr = sin_addr;
     client->address.sin_port = htons(port);
-    printf("Set client address to %s:%u\n", addr_str, port);
+    log_debug(LOG_DATA, "Set client address to %s:%u", addr_str, port);
     return write_reply(client, 200, "PORT command successful.");
 }
 
@@ -344,6 +460,7 @@ static s32 prepare_data_connection_active(client_t *client, data_connection_call
     s32 data_socket = net_socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
     if (data_socket < 0) return data_socket;
     set_blocking(data_socket, false);
+    set_nodelay(data_socket);
     struct sockaddr_in bindAddress;
     memset(&bindAddress, 0, sizeof(bindAddress));
     bindAddress.sin_family = AF_INET;
@@ -356,17 +473,19 @@ static s32 prepare_data_connection_active(client_t *client, data_connection_call
     }
     
     client->data_socket = data_socket;
-    printf("Attempting to connect to client at %s:%u\n", inet_ntoa(client->address.sin_addr), ntohs(client->address.sin_port));
+    log_debug(LOG_DATA, "Attempting to connect to client at %s:%u", inet_ntoa(client->address.sin_addr), ntohs(client->address.sin_port));
+    // completion (or failure) is reported as writability, and finished off in process_data_events
+    net_connect(data_socket, (struct sockaddr *)&client->address, sizeof(client->address));
     return 0;
 }
 
 static s32 prepare_data_connection_passive(client_t *client, data_connection_callback callback, void *arg) {
     client->data_socket = client->passive_socket;
-    printf("Waiting for data connections...\n");
+    log_debug(LOG_DATA, "Waiting for data connections...");
     return 0;
 }
 
-static s32 prepare_data_connection(client_t *client, void *callback, void *arg, void *cleanup) {
+static s32 prepare_data_connection(client_t *client, void *callback, void *arg, void *cleanup, bool receiving) {
     s32 result = write_reply(client, 150, "Transferring data.");
     if (result >= 0) {
         data_connection_handler handler = prepare_data_connection_active;
@@ -376,6 +495,8 @@ static s32 prepare_data_connection(client_t *client, void *callback, void *arg,
             result = write_reply(client, 520, "Closing data connection, error occurred during transfer.");
         } else {
             client->data_connection_connected = false;
+            client->data_connection_receiving = receiving;
+            client->data_connection_busy = false;
             client->data_callback = callback;
             client->data_connection_callback_arg = arg;
             client->data_connection_cleanup = cleanup;
@@ -385,37 +506,47 @@ static s32 prepare_data_connection(client_t *client, void *callback, void *arg,
     return result;
 }
 
-static s32 send_nlst(s32 data_socket, DIR_P *iter) {
-    s32 result = 0;
-    char filename[PATH_MAX];
+/*
+    Reserves room for one listing line directly in the output queue, so entries are formatted in place.
+    Commit what was written with commit_listing_line.
+*/
+static char *reserve_listing_line(output_queue_t *output) {
+    return queue_reserve(output, LISTING_LINE_MAX);
+}
+
+static void commit_listing_line(output_queue_t *output, s32 length) {
+    if (length < 0) return;
+    queue_commit(output, MIN(length, LISTING_LINE_MAX - 1));
+}
+
+/*
+    Listing callbacks format up to LISTING_ENTRIES_PER_CALL entries per call, stopping early once
+    DATA_FLUSH_SIZE bytes are waiting, then yield so that other clients are not held up by a large
+    (or uncached, and so slow to stat) directory.  process_data_events only flushes whole flush units
+    until the listing is complete, so the entries go out in full segments rather than one per write.
+*/
+static s32 send_nlst(s32 data_socket, output_queue_t *output, DIR_P *iter) {
     struct dirent *dirent = NULL;
-    while ((dirent = vrt_readdir(iter)) != 0) {
-        size_t end_index = strlen(dirent->d_name);
-        if(end_index + 2 >= PATH_MAX)
-            continue;
-        strcpy(filename, dirent->d_name);
-        filename[end_index] = CRLF[0];
-        filename[end_index + 1] = CRLF[1];
-        filename[end_index + 2] = '\0';
-        if ((result = send_exact(data_socket, filename, strlen(filename))) < 0) {
-            break;
-        }
+    u32 entries;
+    for (entries = 0; entries < LISTING_ENTRIES_PER_CALL && queue_length(output) < DATA_FLUSH_SIZE; entries++) {
+        if (!(dirent = vrt_readdir(iter))) return 0;
+        char *line = reserve_listing_line(output);
+        if (!line) return -ENOMEM;
+        commit_listing_line(output, snprintf(line, LISTING_LINE_MAX, "%s\r\n", dirent->d_name));
     }
-    return result < 0 ? result : 0;
+    return -EAGAIN;
 }
 
-static s32 send_list(s32 data_socket, DIR_P *iter) {
+static s32 send_list(s32 data_socket, output_queue_t *output, DIR_P *iter) {
     struct stat st;
-    s32 result = 0;
     time_t mtime = 0;
     u64 size = 0;
-    char filename[PATH_MAX];
-    char line[PATH_MAX + 56 + CRLF_LENGTH + 1];
     struct dirent *dirent = NULL;
-    while ((dirent = vrt_readdir(iter)) != 0) {
+    u32 entries;
+    for (entries = 0; entries < LISTING_ENTRIES_PER_CALL && queue_length(output) < DATA_FLUSH_SIZE; entries++) {
+        if (!(dirent = vrt_readdir(iter))) return 0;
 
-        snprintf(filename, sizeof(filename), "%s/%s", iter->path, dirent->d_name);
-        if(stat(filename, &st) == 0)
+        if(vrt_stat_entry(iter, &st) == 0)
         {
             mtime = st.st_mtime;
             size = st.st_size;
@@ -428,12 +559,32 @@ static s32 send_list(s32 data_socket, DIR_P *iter) {
 
         char timestamp[13];
         strftime(timestamp, sizeof(timestamp), "%b %d  %Y", localtime(&mtime));
-        snprintf(line, sizeof(line), "%crwxr-xr-x	1 0		0	 %10llu %s %s\r\n", (dirent->d_type & DT_DIR) ? 'd' : '-', size, timestamp, dirent->d_name);
-        if ((result = send_exact(data_socket, line, strlen(line))) < 0) {
-            break;
-        }
+        char *line = reserve_listing_line(output);
+        if (!line) return -ENOMEM;
+        commit_listing_line(output, snprintf(line, LISTING_LINE_MAX, "%crwxr-xr-x	1 0		0	 %10llu %s %s\r\n", (dirent->d_type & DT_DIR) ? 'd' : '-', size, timestamp, dirent->d_name));
+    }
+    return -EAGAIN;
+}
+
+static s32 send_mlsd(s32 data_socket, output_queue_t *output, DIR_P *iter) {
+    struct stat st;
+    struct dirent *dirent = NULL;
+    u32 entries;
+    for (entries = 0; entries < LISTING_ENTRIES_PER_CALL && queue_length(output) < DATA_FLUSH_SIZE; entries++) {
+        if (!(dirent = vrt_readdir(iter))) return 0;
+
+        const char *type = (dirent->d_type & DT_DIR) ? "dir" : "file";
+        if (!strcmp(dirent->d_name, ".")) type = "cdir";
+        else if (!strcmp(dirent->d_name, "..")) type = "pdir";
+
+        char *line = reserve_listing_line(output);
+        if (!line) return -ENOMEM;
+        s32 length = format_facts(line, LISTING_LINE_MAX - CRLF_LENGTH, type, vrt_stat_entry(iter, &st) ? NULL : &st, dirent->d_name);
+        length = MIN(length, LISTING_LINE_MAX - CRLF_LENGTH - 1);
+        strcpy(line + length, CRLF);
+        commit_listing_line(output, length + CRLF_LENGTH);
     }
-    return result < 0 ? result : 0;
+    return -EAGAIN;
 }
 
 static s32 ftp_NLST(client_t *client, char *path) {
@@ -446,7 +597,7 @@ static s32 ftp_NLST(client_t *client, char *path) {
         return write_reply(client, 550, strerror(errno));
     }
 
-    s32 result = prepare_data_connection(client, send_nlst, dir, vrt_closedir);
+    s32 result = prepare_data_connection(client, send_nlst, dir, vrt_closedir, false);
     if (result < 0) vrt_closedir(dir);
     return result;
 }
@@ -454,11 +605,7 @@ static s32 ftp_NLST(client_t *client, char *path) {
 static s32 ftp_LIST(client_t *client, char *path) {
     if (*path == '-') {
         // handle buggy clients that use "LIST -aL" or similar, at the expense of breaking paths that begin with '-'
-        char flags[FTP_BUFFER_SIZE];
-        char rest[FTP_BUFFER_SIZE];
-        char *args[] = { flags, rest };
-        split(path, ' ', 1, args);
-        path = rest;
+        path = split_word(path);
     }
     if (!*path) {
         path = ".";
@@ -469,7 +616,22 @@ static s32 ftp_LIST(client_t *client, char *path) {
         return write_reply(client, 550, strerror(errno));
     }
 
-    s32 result = prepare_data_connection(client, send_list, dir, vrt_closedir);
+    s32 result = prepare_data_connection(client, send_list, dir, vrt_closedir, false);
+    if (result < 0) vrt_closedir(dir);
+    return result;
+}
+
+static s32 ftp_MLSD(client_t *client, char *path) {
+    if (!*path) {
+        path = ".";
+    }
+
+    DIR_P *dir = vrt_opendir(client->cwd, path);
+    if (dir == NULL) {
+        return write_reply(client, 550, strerror(errno));
+    }
+
+    s32 result = prepare_data_connection(client, send_mlsd, dir, vrt_closedir, false);
     if (result < 0) vrt_closedir(dir);
     return result;
 }
@@ -480,50 +642,119 @@ static s32 ftp_RETR(client_t *client, char *path) {
         return write_reply(client, 550, strerror(errno));
     }
 
-    int fd = fileno(f);
-    if (client->restart_marker && lseek(fd, client->restart_marker, SEEK_SET) != client->restart_marker) {
-        s32 lseek_error = errno;
+    if (client->restart_marker && fseeko(f, client->restart_marker, SEEK_SET)) { // generated /ftpii files have no descriptor
+        s32 seek_error = errno;
         fclose(f);
         client->restart_marker = 0;
-        return write_reply(client, 550, strerror(lseek_error));
+        return write_reply(client, 550, strerror(seek_error));
     }
     client->restart_marker = 0;
 
-    s32 result = prepare_data_connection(client, send_from_file, f, fclose);
-    if (result < 0) fclose(f);
+    vrt_path_t resolved;
+    const char *real_path = NULL;
+    if (!vrt_resolve(client->cwd, path, &resolved) && !procfs_path(resolved.real_path)) { // generated files change under the cache
+        real_path = resolved.real_path;
+    }
+    transfer_t *transfer = start_download(f, real_path, client - client_slots);
+    if (!transfer) {
+        return write_reply(client, 550, strerror(errno));
+    }
+
+    s32 result = prepare_data_connection(client, send_download, transfer, finish_download, false);
+    if (result < 0) finish_download(transfer);
     return result;
 }
 
-static s32 stor_or_append(client_t *client, FILE *f) {
+/*
+    Starts receiving into f, which is positioned where the upload begins.
+    The part of an ALLO'd size that f doesn't already hold is reserved first, failing with 552 if it won't fit.
+*/
+static s32 stor_or_append(client_t *client, char *path, FILE *f) {
     if (!f) {
         return write_reply(client, 550, strerror(errno));
     }
-    s32 result = prepare_data_connection(client, recv_to_file, f, fclose);
-    if (result < 0) fclose(f);
+    vrt_path_t resolved;
+    const char *real_path = vrt_resolve(client->cwd, path, &resolved) ? NULL : resolved.real_path;
+    off_t position = ftello(f);
+    u64 reserved = client->allocation - MIN(client->allocation, (u64)MAX(position, 0));
+    if (real_path && !reserve_space(real_path, reserved)) {
+        s32 reserve_error = errno;
+        fclose(f);
+        return write_reply(client, 552, strerror(reserve_error));
+    }
+    if (!real_path) reserved = 0;
+    transfer_t *transfer = start_upload(f, real_path, client - client_slots, reserved);
+    if (!transfer) {
+        s32 start_error = errno;
+        fclose(f);
+        return write_reply(client, 550, strerror(start_error));
+    }
+    s32 result = prepare_data_connection(client, receive_upload, transfer, finish_upload, true);
+    if (result < 0) finish_upload(transfer);
     return result;
 }
 
-static s32 ftp_STOR(client_t *client, char *path) {
-    FILE *f = vrt_fopen(client->cwd, path, "wb");
-    int fd;
-    if (f) fd = fileno(f);
-    if (f && client->restart_marker && lseek(fd, client->restart_marker, SEEK_SET) != client->restart_marker) {
-        s32 lseek_error = errno;
+/*
+    Reopens path for a STOR after REST without truncating it, positioned at offset.
+    The offset may be neither past the end of the file nor past what its journal says reached the card.
+*/
+static s32 resume_upload(client_t *client, char *path, off_t offset) {
+    FILE *f = vrt_fopen(client->cwd, path, "r+b");
+    if (!f) {
+        return write_reply(client, 550, strerror(errno));
+    }
+    if (fseeko(f, 0, SEEK_END)) {
+        s32 seek_error = errno;
         fclose(f);
-        client->restart_marker = 0;
-        return write_reply(client, 550, strerror(lseek_error));
+        return write_reply(client, 550, strerror(seek_error));
     }
-    client->restart_marker = 0;
+    off_t size = ftello(f);
+    vrt_path_t resolved;
+    u64 committed;
+    if (!vrt_resolve(client->cwd, path, &resolved) && journal_length(resolved.real_path, &committed)) size = MIN((u64)size, committed);
+    if (offset > size) {
+        fclose(f);
+        return write_reply(client, 554, "Restart offset is past the end of the file.");
+    }
+    if (fseeko(f, offset, SEEK_SET)) {
+        s32 seek_error = errno;
+        fclose(f);
+        return write_reply(client, 550, strerror(seek_error));
+    }
+    return stor_or_append(client, path, f);
+}
 
-    return stor_or_append(client, f);
+static s32 ftp_STOR(client_t *client, char *path) {
+    off_t offset = client->restart_marker;
+    client->restart_marker = 0;
+    s32 result = offset ? resume_upload(client, path, offset) : stor_or_append(client, path, vrt_fopen(client->cwd, path, "wb"));
+    client->allocation = 0;
+    return result;
 }
 
 static s32 ftp_APPE(client_t *client, char *path) {
-    return stor_or_append(client, vrt_fopen(client->cwd, path, "ab"));
+    FILE *f = vrt_fopen(client->cwd, path, "ab");
+    if (f) fseeko(f, 0, SEEK_END); // so that the upload knows where it starts
+    s32 result = stor_or_append(client, path, f);
+    client->allocation = 0;
+    return result;
+}
+
+/*
+    "ALLO <size> [R <record size>]" announces the size of the file the next STOR or APPE will leave behind.
+*/
+static s32 ftp_ALLO(client_t *client, char *rest) {
+    long long size;
+    if (sscanf(rest, "%lli", &size) < 1 || size < 0) {
+        return write_reply(client, 501, "Syntax error in parameters.");
+    }
+    client->allocation = size;
+    if (!size) return write_reply(client, 202, "No storage allocation necessary.");
+    return write_reply(client, 200, "ALLO command successful.");
 }
 
 static s32 ftp_REST(client_t *client, char *offset_str) {
-    off_t offset;
+    long long offset;
     if (sscanf(offset_str, "%lli", &offset) < 1 || offset < 0) {
         return write_reply(client, 501, "Syntax error in parameters.");
     }
@@ -541,6 +772,7 @@ static s32 ftp_SITE_LOADER(client_t *client, char *rest) {
 
 static s32 ftp_SITE_CLEAR(client_t *client, char *rest) {
     s32 result = write_reply(client, 200, "Cleared.");
+    log_drain();
     u32 i;
     for (i = 0; i < 100; i++) printf("\n");
     printf("\x1b[2;0H");
@@ -571,40 +803,90 @@ static s32 ftp_SITE_MOUNT(client_t *client, char *path) {
 }
 
 static s32 ftp_SITE_UNMOUNT(client_t *client, char *path) {
-    if (!unmount_virtual(path)) return write_reply(client, 550, "Unable to unmount.");
+    if (!unmount_virtual(path)) {
+        if (errno == EBUSY) return write_reply(client, 450, "Files are open on that device, try again once their transfers finish.");
+        return write_reply(client, 550, "Unable to unmount.");
+    }
     return write_reply(client, 250, "Unmounted.");
 }
 
-static s32 ftp_SITE_UNKNOWN(client_t *client, char *rest) {
-    return write_reply(client, 501, "Unknown SITE command.");
+/*
+    "SITE CACHE <device> <auto|browse|stream|off|PAGESxSECTORS>" reshapes a partition's sector cache,
+    remounting it if it is mounted.
+*/
+static s32 ftp_SITE_CACHE(client_t *client, char *rest) {
+    char *dir = rest;
+    char *setting = split_word(rest);
+    if (!retune_cache(dir, setting)) {
+        if (errno == EBUSY) return write_reply(client, 450, "Files are open on that device, try again once their transfers finish.");
+        return write_reply(client, 550, "Unable to retune cache.");
+    }
+    return write_reply(client, 200, "Cache retuned.");
 }
 
-typedef s32 (*ftp_command_handler)(client_t *client, char *args);
+static s32 ftp_SITE_LOG(client_t *client, char *rest) {
+    char *level = rest;
+    char *subsystem = split_word(rest);
+    if (!set_log_level(subsystem, level)) return write_reply(client, 501, "Syntax error in parameters.");
+    return write_reply(client, 200, "Log level changed.");
+}
 
-static s32 dispatch_to_handler(client_t *client, char *cmd_line, const char **commands, const ftp_command_handler *handlers) {
-    char cmd[FTP_BUFFER_SIZE], rest[FTP_BUFFER_SIZE];
-    char *args[] = { cmd, rest };
-    split(cmd_line, ' ', 1, args); 
-    s32 i;
-    for (i = 0; commands[i]; i++) {
-        if (!strcasecmp(commands[i], cmd)) break;
-    }
-    return handlers[i](client, rest);
+static s32 ftp_SITE_UNKNOWN(client_t *client, char *rest) {
+    return write_reply(client, 501, "Unknown SITE command.");
 }
 
-static const char *site_commands[] = { "LOADER", "CLEAR", "CHMOD", "PASSWD", "NOPASSWD", "MOUNT", "UNMOUNT", NULL };
-static const ftp_command_handler site_handlers[] = { ftp_SITE_LOADER, ftp_SITE_CLEAR, ftp_SITE_CHMOD, ftp_SITE_PASSWD, ftp_SITE_NOPASSWD, ftp_SITE_MOUNT, ftp_SITE_UNMOUNT, ftp_SITE_UNKNOWN };
+static s32 ftp_SITE(client_t *client, char *cmd_line);
+static s32 ftp_SITE_STATS(client_t *client, char *rest);
 
-static s32 ftp_SITE(client_t *client, char *cmd_line) {
-    return dispatch_to_handler(client, cmd_line, site_commands, site_handlers);
+static const char *features[] = { "EPSV", "MDTM", "MLST type*;size*;modify*;", "REST STREAM", "SIZE", NULL };
+
+static s32 ftp_FEAT(client_t *client, char *rest) {
+    return write_multiline_reply(client, 211, "Features:", features, "End");
 }
 
 static s32 ftp_NOOP(client_t *client, char *rest) {
     return write_reply(client, 200, "NOOP command successful.");
 }
 
-static s32 ftp_SUPERFLUOUS(client_t *client, char *rest) {
-    return write_reply(client, 202, "Command not implemented, superfluous at this site.");
+static void cleanup_data_resources(client_t *client);
+
+/*
+    Out of band: closes the data connection of the transfer in progress, whose 426 and this command's 226
+    then go out ahead of the commands queued behind it.
+*/
+static s32 ftp_ABOR(client_t *client, char *rest) {
+    if (!client->data_callback) {
+        return write_reply(client, 226, "No transfer to abort.");
+    }
+    trace_event(TRACE_DATA_CLOSE, client - client_slots, -ECONNABORTED, 0);
+    cleanup_data_resources(client);
+    s32 result = write_reply(client, 426, "Connection closed; transfer aborted.");
+    if (result >= 0) result = write_reply(client, 226, "Abort successful.");
+    return result;
+}
+
+static const char *transfer_state(client_t *client);
+
+/*
+    Out of band: reports the session, including the state of any transfer in progress.
+    Listing a path over the control connection is not supported.
+*/
+static s32 ftp_STAT(client_t *client, char *rest) {
+    if (*rest) {
+        return write_reply(client, 504, "Command not implemented for that parameter.");
+    }
+    char line[PATH_MAX + 32];
+    s32 result = queue_reply_line(client, 211, '-', "FTP server status:");
+    snprintf(line, sizeof(line), "Logged in: %s", client->authenticated ? "yes" : "no");
+    if (result >= 0) result = queue_reply_line(client, 0, ' ', line);
+    snprintf(line, sizeof(line), "Working directory: %s", client->cwd);
+    if (result >= 0) result = queue_reply_line(client, 0, ' ', line);
+    snprintf(line, sizeof(line), "Type: %s", client->representation_type == 'I' ? "binary" : "ASCII");
+    if (result >= 0) result = queue_reply_line(client, 0, ' ', line);
+    snprintf(line, sizeof(line), "Transfer: %s", transfer_state(client));
+    if (result >= 0) result = queue_reply_line(client, 0, ' ', line);
+    if (result >= 0) result = queue_reply_line(client, 211, ' ', "End of status");
+    return result;
 }
 
 static s32 ftp_NEEDAUTH(client_t *client, char *rest) {
@@ -615,51 +897,280 @@ static s32 ftp_UNKNOWN(client_t *client, char *rest) {
     return write_reply(client, 502, "Command not implemented.");
 }
 
-static const char *unauthenticated_commands[] = { "USER", "PASS", "QUIT", "REIN", "NOOP", NULL };
-static const ftp_command_handler unauthenticated_handlers[] = { ftp_USER, ftp_PASS, ftp_QUIT, ftp_REIN, ftp_NOOP, ftp_NEEDAUTH };
+typedef s32 (*ftp_command_handler)(client_t *client, char *args);
 
-static const char *authenticated_commands[] = {
-    "USER", "PASS", "LIST", "PWD", "CWD", "CDUP",
-    "SIZE", "PASV", "PORT", "TYPE", "SYST", "MODE",
-    "RETR", "STOR", "APPE", "REST", "DELE", "MKD",
-    "RMD", "RNFR", "RNTO", "NLST", "QUIT", "REIN",
-    "SITE", "NOOP", "ALLO", NULL
+#define CMD_NEEDS_AUTH 0x1
+#define CMD_DURING_TRANSFER 0x2 // out of band: runs at once instead of waiting behind the transfer in progress
+
+typedef struct {
+    const char *name;
+    ftp_command_handler handler;
+    u8 flags;
+} ftp_command_t;
+
+static const ftp_command_t command_list[] = {
+    { "USER", ftp_USER, 0 },
+    { "PASS", ftp_PASS, 0 },
+    { "QUIT", ftp_QUIT, 0 },
+    { "REIN", ftp_REIN, 0 },
+    { "NOOP", ftp_NOOP, 0 },
+    { "FEAT", ftp_FEAT, 0 },
+    { "ABOR", ftp_ABOR, CMD_NEEDS_AUTH | CMD_DURING_TRANSFER },
+    { "STAT", ftp_STAT, CMD_NEEDS_AUTH | CMD_DURING_TRANSFER },
+    { "SYST", ftp_SYST, CMD_NEEDS_AUTH },
+    { "PWD", ftp_PWD, CMD_NEEDS_AUTH },
+    { "SIZE", ftp_SIZE, CMD_NEEDS_AUTH },
+    { "MDTM", ftp_MDTM, CMD_NEEDS_AUTH },
+    { "MLST", ftp_MLST, CMD_NEEDS_AUTH },
+    { "CWD", ftp_CWD, CMD_NEEDS_AUTH },
+    { "CDUP", ftp_CDUP, CMD_NEEDS_AUTH },
+    { "PASV", ftp_PASV, CMD_NEEDS_AUTH },
+    { "EPSV", ftp_EPSV, CMD_NEEDS_AUTH },
+    { "PORT", ftp_PORT, CMD_NEEDS_AUTH },
+    { "TYPE", ftp_TYPE, CMD_NEEDS_AUTH },
+    { "MODE", ftp_MODE, CMD_NEEDS_AUTH },
+    { "REST", ftp_REST, CMD_NEEDS_AUTH },
+    { "DELE", ftp_DELE, CMD_NEEDS_AUTH },
+    { "RMD", ftp_DELE, CMD_NEEDS_AUTH },
+    { "MKD", ftp_MKD, CMD_NEEDS_AUTH },
+    { "RNFR", ftp_RNFR, CMD_NEEDS_AUTH },
+    { "RNTO", ftp_RNTO, CMD_NEEDS_AUTH },
+    { "SITE", ftp_SITE, CMD_NEEDS_AUTH },
+    { "ALLO", ftp_ALLO, CMD_NEEDS_AUTH },
+    { "LIST", ftp_LIST, CMD_NEEDS_AUTH },
+    { "NLST", ftp_NLST, CMD_NEEDS_AUTH },
+    { "MLSD", ftp_MLSD, CMD_NEEDS_AUTH },
+    { "RETR", ftp_RETR, CMD_NEEDS_AUTH },
+    { "STOR", ftp_STOR, CMD_NEEDS_AUTH },
+    { "APPE", ftp_APPE, CMD_NEEDS_AUTH },
+    { NULL }
 };
-static const ftp_command_handler authenticated_handlers[] = {
-    ftp_USER, ftp_PASS, ftp_LIST, ftp_PWD, ftp_CWD, ftp_CDUP,
-    ftp_SIZE, ftp_PASV, ftp_PORT, ftp_TYPE, ftp_SYST, ftp_MODE,
-    ftp_RETR, ftp_STOR, ftp_APPE, ftp_REST, ftp_DELE, ftp_MKD,
-    ftp_DELE, ftp_RNFR, ftp_RNTO, ftp_NLST, ftp_QUIT, ftp_REIN,
-    ftp_SITE, ftp_NOOP, ftp_SUPERFLUOUS, ftp_UNKNOWN
+
+static const ftp_command_t site_command_list[] = {
+    { "LOADER", ftp_SITE_LOADER, 0 },
+    { "CLEAR", ftp_SITE_CLEAR, 0 },
+    { "CHMOD", ftp_SITE_CHMOD, 0 },
+    { "PASSWD", ftp_SITE_PASSWD, 0 },
+    { "NOPASSWD", ftp_SITE_NOPASSWD, 0 },
+    { "MOUNT", ftp_SITE_MOUNT, 0 },
+    { "UNMOUNT", ftp_SITE_UNMOUNT, 0 },
+    { "CACHE", ftp_SITE_CACHE, 0 },
+    { "LOG", ftp_SITE_LOG, 0 },
+    { "STATS", ftp_SITE_STATS, 0 },
+    { NULL }
 };
 
+#define NUM_COMMANDS (sizeof(command_list) / sizeof(*command_list) - 1)
+
+/*
+    Handling time per verb, indexed like command_list, with unknown verbs counted in the last slot.
+*/
+static latency_stats_t command_latency[NUM_COMMANDS + 1];
+
+#define COMMAND_HASH_BITS 6
+#define COMMAND_SLOTS (1 << COMMAND_HASH_BITS)
+
+typedef struct {
+    u32 key;
+    const ftp_command_t *command;
+} command_slot_t;
+
+typedef struct {
+    const ftp_command_t *list;
+    command_slot_t slots[COMMAND_SLOTS];
+} command_table_t;
+
+static command_table_t commands = { command_list };
+static command_table_t site_commands = { site_command_list };
+
 /*
-    returns negative to signal an error that requires closing the connection
+    Packs the first four characters of the length-character verb, upper-cased, into a single word.
+    Every FTP verb fits, so for them this alone identifies the command.
+*/
+static u32 verb_key(const char *verb, u32 length) {
+    u32 key = 0;
+    u32 i;
+    for (i = 0; i < 4 && i < length; i++) {
+        key |= (u32)(u8)toupper((u8)verb[i]) << (24 - 8 * i);
+    }
+    return key;
+}
+
+static u32 command_hash(u32 key) {
+    return (key * 2654435761u) >> (32 - COMMAND_HASH_BITS);
+}
+
+static void build_command_table(command_table_t *table) {
+    memset(table->slots, 0, sizeof(table->slots));
+    const ftp_command_t *command;
+    for (command = table->list; command->name; command++) {
+        u32 key = verb_key(command->name, strlen(command->name));
+        u32 slot;
+        for (slot = command_hash(key); table->slots[slot].command; slot = (slot + 1) % COMMAND_SLOTS);
+        table->slots[slot].key = key;
+        table->slots[slot].command = command;
+    }
+}
+
+/*
+    Looks up the first length characters of verb, which need not be terminated there.  Returns NULL if it is not in the table.
+    Only verbs longer than four characters (i.e. SITE subcommands) need a string comparison.
+*/
+static const ftp_command_t *lookup_command(const command_table_t *table, const char *verb, u32 length) {
+    u32 key = verb_key(verb, length);
+    u32 slot;
+    for (slot = command_hash(key); table->slots[slot].command; slot = (slot + 1) % COMMAND_SLOTS) {
+        const command_slot_t *entry = table->slots + slot;
+        const char *name = entry->command->name;
+        if (entry->key != key) continue;
+        if ((length <= 4 || !strncasecmp(name + 4, verb + 4, length - 4)) && !name[length]) return entry->command;
+    }
+    return NULL;
+}
+
+/*
+    Preallocates as many session slots as fit in memory_budget bytes, between 1 and MAX_CLIENT_SLOTS.
+*/
+void initialise_ftp(u32 memory_budget) {
+    build_command_table(&commands);
+    build_command_table(&site_commands);
+    max_clients = MAX(1, MIN(MAX_CLIENT_SLOTS, memory_budget / sizeof(client_t)));
+    client_slots = calloc(max_clients, sizeof(client_t));
+    if (!client_slots) die("Unable to allocate memory for client sessions", ENOMEM);
+    initialise_passive_ports();
+    root_cwd = intern_string("/");
+    if (!root_cwd) die("Unable to allocate memory for client sessions", ENOMEM);
+}
+
+static s32 ftp_SITE(client_t *client, char *cmd_line) {
+    char *rest = split_word(cmd_line);
+    const ftp_command_t *command = lookup_command(&site_commands, cmd_line, strlen(cmd_line));
+    if (!command) return ftp_SITE_UNKNOWN(client, rest);
+    return command->handler(client, rest);
+}
+
+/*
+    cmd_line is tokenised in place, unless the command has to wait for the current transfer to finish,
+    in which case it is left untouched and -EAGAIN is returned.
+    returns any other negative to signal an error that requires closing the connection
 */
 static s32 process_command(client_t *client, char *cmd_line) {
-    if (strlen(cmd_line) == 0) {
+    while (*cmd_line == ' ') cmd_line++;
+    if (!*cmd_line) {
         return 0;
     }
 
-    printf("Got command: %s\n", cmd_line);
+    u32 verb_length = strcspn(cmd_line, " ");
+    const ftp_command_t *command = lookup_command(&commands, cmd_line, verb_length);
+    if (client->data_callback && (!command || !(command->flags & CMD_DURING_TRANSFER))) {
+        return -EAGAIN;
+    }
+
+    log_debug(LOG_FTP, "Got command: %s", cmd_line);
+
+    u8 session = client - client_slots;
+    u32 verb = verb_key(cmd_line, verb_length);
+    trace_event(TRACE_COMMAND_START, session, verb, 0);
+    u64 start = gettime();
+    s32 result;
+    char *rest = split_word(cmd_line);
+    if (!client->authenticated && (!command || (command->flags & CMD_NEEDS_AUTH))) {
+        result = ftp_NEEDAUTH(client, rest);
+    } else if (!command) {
+        result = ftp_UNKNOWN(client, rest);
+    } else {
+        result = command->handler(client, rest);
+    }
+    u64 ticks = diff_ticks(start, gettime());
+    record_latency(command_latency + (command ? command - command_list : NUM_COMMANDS), ticks);
+    trace_event(TRACE_COMMAND_END, session, verb, ticks);
+    return result;
+}
+
+/*
+    Writes the transfer, device and connection counters followed by per-command latencies.
+*/
+s32 write_all_stats(stats_line_writer write, void *arg, bool machine) {
+    s32 result = write_stats(write, arg, machine);
+    u32 i;
+    for (i = 0; i <= NUM_COMMANDS && result >= 0; i++) {
+        if (!command_latency[i].count) continue;
+        char line[256];
+        format_latency(line, sizeof(line), "command", i < NUM_COMMANDS ? command_list[i].name : "other", command_latency + i, machine);
+        result = write(arg, line);
+    }
+    return result;
+}
 
-    const char **commands = unauthenticated_commands;
-    const ftp_command_handler *handlers = unauthenticated_handlers;
+static s32 write_stats_line(void *arg, const char *line) {
+    return queue_reply_line((client_t *)arg, 0, ' ', line);
+}
 
-    if (client->authenticated) {
-        commands = authenticated_commands;
-        handlers = authenticated_handlers;
+/*
+    "SITE STATS" for a human-readable summary, "SITE STATS RAW" for one fact line per counter,
+    and "SITE STATS RESET" to start counting again.
+*/
+static s32 ftp_SITE_STATS(client_t *client, char *rest) {
+    if (!strcasecmp("RESET", rest)) {
+        memset(command_latency, 0, sizeof(command_latency));
+        reset_stats();
+        return write_reply(client, 200, "Statistics reset.");
     }
+    bool machine = !strcasecmp("RAW", rest);
+    if (*rest && !machine) {
+        return write_reply(client, 501, "Syntax error in parameters.");
+    }
+    s32 result = queue_reply_line(client, 211, '-', "Statistics:");
+    if (result >= 0) result = write_all_stats(write_stats_line, client, machine);
+    if (result >= 0) result = queue_reply_line(client, 211, ' ', "End");
+    return result;
+}
 
-    return dispatch_to_handler(client, cmd_line, commands, handlers);
+/*
+    Runs the complete lines waiting in client->buf, in order, stopping at the first one that has to wait
+    for the current transfer to finish.  Lines that were run are removed from the buffer.
+    returns negative if the connection should be closed
+*/
+static s32 process_buffered_commands(client_t *client) {
+    s32 result = 0;
+    char *next;
+    char *end;
+    for (next = client->buf; (end = strstr(next, CRLF)); next = end + CRLF_LENGTH) {
+        *end = '\0';
+        if (strchr(next, '\n')) {
+            log_warning(LOG_FTP, "Received a line-feed from client without preceding carriage return, closing connection ;-)"); // i have decided this isn't allowed =P
+            result = -EINVAL;
+            break;
+        }
+        if ((result = process_command(client, next)) == -EAGAIN) {
+            *end = *CRLF;
+            result = 0;
+            break;
+        } else if (result < 0) {
+            if (result != -EQUIT) {
+                log_warning(LOG_FTP, "Closing connection due to error while processing command: %s", next);
+            }
+            break;
+        }
+    }
+
+    if (next != client->buf) { // some lines were processed
+        client->offset -= next - client->buf;
+        memmove(client->buf, next, client->offset + 1);
+    }
+    return result;
 }
 
 static void cleanup_data_resources(client_t *client) {
     if (client->data_socket >= 0 && client->data_socket != client->passive_socket) {
         net_close_blocking(client->data_socket);
     }
+    log_chunk_sizer(LOG_DATA, "Data connection", &client->data_output.sizer);
+    queue_free(&client->data_output);
     client->data_socket = -1;
     client->data_connection_connected = false;
+    client->data_connection_receiving = false;
+    client->data_connection_busy = false;
     client->data_callback = NULL;
     if (client->data_connection_cleanup) {
         client->data_connection_cleanup(client->data_connection_callback_arg);
@@ -670,104 +1181,156 @@ static void cleanup_data_resources(client_t *client) {
 }
 
 static void cleanup_client(client_t *client) {
+    queue_flush(client->socket, &client->replies); // last chance for e.g. the reply to QUIT
     net_close_blocking(client->socket);
     cleanup_data_resources(client);
     close_passive_socket(client);
-    int client_index;
-    for (client_index = 0; client_index < MAX_CLIENTS; client_index++) {
-        if (clients[client_index] == client) {
-            clients[client_index] = NULL;
-            break;
-        }
-    }
-    free(client);
+    log_chunk_sizer(LOG_FTP, "Control connection", &client->replies.sizer);
+    queue_free(&client->replies);
+    release_string(client->cwd);
+    release_string(client->pending_rename);
+    client->in_use = false;
     num_clients--;
-    printf("Client disconnected.\n");
+    log_info(LOG_FTP, "Client disconnected.");
 }
 
 void cleanup_ftp() {
     int client_index;
-    for (client_index = 0; client_index < MAX_CLIENTS; client_index++) {
-        client_t *client = clients[client_index];
-        if (client) {
+    for (client_index = 0; client_index < max_clients; client_index++) {
+        client_t *client = client_slots + client_index;
+        if (client->in_use) {
             write_reply(client, 421, "Service not available, closing control connection.");
             cleanup_client(client);
         }
     }
+    close_spare_passive_sockets();
+}
+
+/*
+    Whether any client has a data connection open or pending, and so may be using the SD bus.
+*/
+bool ftp_transfers_active() {
+    int client_index;
+    for (client_index = 0; client_index < max_clients; client_index++) {
+        if (client_slots[client_index].in_use && client_slots[client_index].data_callback) return true;
+    }
+    return false;
+}
+
+static const char *transfer_state(client_t *client) {
+    if (!client->data_callback) return "none";
+    if (!client->data_connection_connected) return "connecting";
+    return client->data_connection_receiving ? "receiving" : "sending";
+}
+
+/*
+    Writes one fact line per connected client, for /ftpii/sessions.
+*/
+s32 write_sessions(stats_line_writer write, void *arg) {
+    s32 result = 0;
+    int client_index;
+    for (client_index = 0; client_index < max_clients && result >= 0; client_index++) {
+        client_t *client = client_slots + client_index;
+        if (!client->in_use) continue;
+        char line[PATH_MAX + 160];
+        snprintf(line, sizeof(line), "slot=%i;address=%s:%u;authenticated=%u;transfer=%s;restart=%llu;allocation=%llu;replies.queued=%u;commands.buffered=%i;cwd=%s;",
+            client_index, inet_ntoa(client->address.sin_addr), ntohs(client->address.sin_port), client->authenticated,
+            transfer_state(client), (unsigned long long)client->restart_marker, client->allocation, queue_length(&client->replies), client->offset, client->cwd);
+        result = write(arg, line);
+    }
+    return result;
 }
 
 static bool process_accept_events(s32 server) {
-    s32 peer;
     struct sockaddr_in client_address;
     socklen_t addrlen = sizeof(client_address);
-    while ((peer = net_accept_nonblocking(server, (struct sockaddr *)&client_address, &addrlen)) != -EAGAIN) {
-        if (peer < 0) {
-            printf("Error accepting connection: [%i] %s\n", -peer, strerror(-peer));
-            return false;
-        }
-
-        printf("Accepted connection from %s!\n", inet_ntoa(client_address.sin_addr));
-
-        if (num_clients == MAX_CLIENTS) {
-            printf("Maximum of %u clients reached, not accepting client.\n", MAX_CLIENTS);
-            net_close(peer);
-            return true;
-        }
+    s32 peer = net_accept(server, (struct sockaddr *)&client_address, &addrlen);
+    if (peer == -EAGAIN) {
+        return true;
+    } else if (peer < 0) {
+        log_error(LOG_FTP, "Error accepting connection: [%i] %s", -peer, strerror(-peer));
+        return false;
+    }
+    set_blocking(peer, false);
+    set_nodelay(peer);
+
+    log_info(LOG_FTP, "Accepted connection from %s!", inet_ntoa(client_address.sin_addr));
+
+    if (num_clients == max_clients) {
+        log_warning(LOG_FTP, "Maximum of %u clients reached, not accepting client.", max_clients);
+        // best effort: the socket is fresh, so a reply this short will fit in its send buffer
+        net_write(peer, TOO_MANY_CLIENTS_REPLY, strlen(TOO_MANY_CLIENTS_REPLY));
+        net_close(peer);
+        connection_stats.rejected++;
+        trace_event(TRACE_REJECT, TRACE_NO_SESSION, ntohl(client_address.sin_addr.s_addr), 0);
+        return true;
+    }
 
-        client_t *client = malloc(sizeof(client_t));
-        if (!client) {
-            printf("Could not allocate memory for client state, not accepting client.\n");
-            net_close(peer);
-            return true;
-        }
-        client->socket = peer;
-        client->representation_type = 'A';
-        client->passive_socket = -1;
-        client->data_socket = -1;
-        strcpy(client->cwd, "/");
-        *client->pending_rename = '\0';
-        client->restart_marker = 0;
-        client->authenticated = false;
-        client->offset = 0;
-        client->data_connection_connected = false;
-        client->data_callback = NULL;
-        client->data_connection_callback_arg = NULL;
-        client->data_connection_cleanup = NULL;
-        client->data_connection_timer = 0;
-        memcpy(&client->address, &client_address, sizeof(client_address));
-        int client_index;
-        if (write_reply(client, 220, "ftpii") < 0) {
-            printf("Error writing greeting.\n");
-            net_close_blocking(peer);
-            free(client);
-        } else {
-            for (client_index = 0; client_index < MAX_CLIENTS; client_index++) {
-                if (!clients[client_index]) {
-                    clients[client_index] = client;
-                    break;
-                }
-            }
-            num_clients++;
-        }
+    client_t *client = client_slots;
+    while (client->in_use) client++;
+    client->socket = peer;
+    client->representation_type = 'A';
+    client->passive_socket = -1;
+    client->epsv_all = false;
+    client->data_socket = -1;
+    client->cwd = retain_string(root_cwd);
+    client->pending_rename = NULL;
+    client->restart_marker = 0;
+    client->allocation = 0;
+    client->authenticated = false;
+    client->offset = 0;
+    queue_init(&client->replies);
+    queue_init(&client->data_output);
+    client->data_connection_connected = false;
+    client->data_connection_receiving = false;
+    client->data_connection_busy = false;
+    client->data_callback = NULL;
+    client->data_connection_callback_arg = NULL;
+    client->data_connection_cleanup = NULL;
+    client->data_connection_timer = 0;
+    memcpy(&client->address, &client_address, sizeof(client_address));
+    if (write_reply(client, 220, "ftpii") < 0 || flush_replies(client) < 0) {
+        log_warning(LOG_FTP, "Error writing greeting.");
+        net_close_blocking(peer);
+        queue_free(&client->replies);
+        release_string(client->cwd);
+    } else {
+        client->in_use = true;
+        num_clients++;
+        connection_stats.accepted++;
+        trace_event(TRACE_ACCEPT, client - client_slots, ntohl(client_address.sin_addr.s_addr), 0);
     }
     return true;
 }
 
-static void process_data_events(client_t *client) {
+/*
+    Stands in for a data callback that has finished producing output,
+    until process_data_events has flushed what remains.
+*/
+static s32 drain_data_output(s32 data_socket, output_queue_t *output, void *arg) {
+    return 0;
+}
+
+/*
+    Returns false if the client was closed.
+*/
+static bool process_data_events(client_t *client) {
     s32 result;
     if (!client->data_connection_connected) {
         if (client->passive_socket >= 0) {
             struct sockaddr_in data_peer_address;
             socklen_t addrlen = sizeof(data_peer_address);
-            result = net_accept_nonblocking(client->passive_socket, (struct sockaddr *)&data_peer_address ,&addrlen);
+            result = net_accept(client->passive_socket, (struct sockaddr *)&data_peer_address, &addrlen);
             if (result >= 0) {
+                set_blocking(result, false);
+                set_nodelay(result);
                 client->data_socket = result;
                 client->data_connection_connected = true;
             }
         } else {
             if ((result = net_connect(client->data_socket, (struct sockaddr *)&client->address, sizeof(client->address))) < 0) {
                 if (result == -EINPROGRESS || result == -EALREADY) result = -EAGAIN;
-                if (result != -EAGAIN && result != -EISCONN) printf("Unable to connect to client: [%i] %s\n", -result, strerror(-result));
+                if (result != -EAGAIN && result != -EISCONN) log_warning(LOG_DATA, "Unable to connect to client: [%i] %s", -result, strerror(-result));
             }
              if (result >= 0 || result == -EISCONN) {
                 client->data_connection_connected = true;
@@ -775,41 +1338,60 @@ static void process_data_events(client_t *client) {
         }
         if (client->data_connection_connected) {
             result = 1;
-            printf("Connected to client!  Transferring data...\n");
+            trace_event(TRACE_DATA_CONNECT, client - client_slots, 0, 0);
+            log_debug(LOG_DATA, "Connected to client!  Transferring data...");
         } else if (gettime() > client->data_connection_timer) {
             result = -1;
-            printf("Timed out waiting for data connection.\n");
+            log_warning(LOG_DATA, "Timed out waiting for data connection.");
         }
     } else {
-        result = client->data_callback(client->data_socket, client->data_connection_callback_arg);
+        // partial flush units are held back while the callback is still producing output
+        result = queue_length(&client->data_output) >= DATA_FLUSH_SIZE ? queue_flush(client->data_socket, &client->data_output) : 0;
+        if (!result) {
+            result = client->data_callback(client->data_socket, &client->data_output, client->data_connection_callback_arg);
+            if (result == 0 || (result == -EAGAIN && queue_length(&client->data_output) >= DATA_FLUSH_SIZE)) {
+                s32 flush_result = queue_flush(client->data_socket, &client->data_output);
+                if (flush_result == -EAGAIN && result == 0) client->data_callback = drain_data_output;
+                if (flush_result < 0) result = flush_result;
+            }
+        }
+        client->data_connection_busy = result == -EBUSY;
     }
 
-    if (result <= 0 && result != -EAGAIN) {
+    if (result <= 0 && result != -EAGAIN && result != -EBUSY) {
+        trace_event(TRACE_DATA_CLOSE, client - client_slots, result, 0);
         cleanup_data_resources(client);
         if (result < 0) {
             result = write_reply(client, 520, "Closing data connection, error occurred during transfer.");
         } else {
             result = write_reply(client, 226, "Closing data connection, transfer successful.");
         }
+        // commands that arrived during the transfer were held back until now
+        if (result >= 0) result = process_buffered_commands(client);
+        if (result >= 0) result = flush_replies(client);
         if (result < 0) {
             cleanup_client(client);
+            return false;
         }
     }
+    return true;
 }
 
-static void process_control_events(client_t *client) {
+/*
+    Reads whatever the client has sent and runs the complete commands, then flushes all of their replies at once.
+    This carries on during a transfer, with commands that have to wait for it held in client->buf.
+    Returns false if the client was closed.
+*/
+static bool process_control_events(client_t *client) {
     s32 bytes_read;
     while (client->offset < (FTP_BUFFER_SIZE - 1)) {
-        if (client->data_callback) {
-            return;
-        }
         char *offset_buf = client->buf + client->offset;
         if ((bytes_read = net_read(client->socket, offset_buf, FTP_BUFFER_SIZE - 1 - client->offset)) < 0) {
             if (bytes_read != -EAGAIN) {
-                printf("Read error %i occurred, closing client.\n", bytes_read);
+                log_warning(LOG_FTP, "Read error %i occurred, closing client.", bytes_read);
                 goto recv_loop_end;
             }
-            return;
+            break;
         } else if (bytes_read == 0) {
             goto recv_loop_end; // EOF from client
         }
@@ -817,56 +1399,135 @@ static void process_control_events(client_t *client) {
         client->buf[client->offset] = '\0';
     
         if (strchr(offset_buf, '\0') != (client->buf + client->offset)) {
-            printf("Received a null byte from client, closing connection ;-)\n"); // i have decided this isn't allowed =P
+            log_warning(LOG_FTP, "Received a null byte from client, closing connection ;-)"); // i have decided this isn't allowed =P
             goto recv_loop_end;
         }
 
-        char *next;
-        char *end;
-        for (next = client->buf; (end = strstr(next, CRLF)) && !client->data_callback; next = end + CRLF_LENGTH) {
-            *end = '\0';
-            if (strchr(next, '\n')) {
-                printf("Received a line-feed from client without preceding carriage return, closing connection ;-)\n"); // i have decided this isn't allowed =P
-                goto recv_loop_end;
-            }
-        
-            if (*next) {
-                s32 result;
-                if ((result = process_command(client, next)) < 0) {
-                    if (result != -EQUIT) {
-                        printf("Closing connection due to error while processing command: %s\n", next);
-                    }
-                    goto recv_loop_end;
-                }
-            }
-        
-        }
-    
-        if (next != client->buf) { // some lines were processed
-            client->offset = strlen(next);
-            char tmp_buf[client->offset];
-            memcpy(tmp_buf, next, client->offset);
-            memcpy(client->buf, tmp_buf, client->offset);
+        if (process_buffered_commands(client) < 0) {
+            goto recv_loop_end;
         }
     }
-    printf("Received line longer than %u bytes, closing client.\n", FTP_BUFFER_SIZE - 1);
+
+    if (client->offset == FTP_BUFFER_SIZE - 1 && !strstr(client->buf, CRLF)) {
+        log_warning(LOG_FTP, "Received line longer than %u bytes, closing client.", FTP_BUFFER_SIZE - 1);
+        goto recv_loop_end;
+    }
+
+    s32 result = flush_replies(client);
+    if (result < 0) {
+        log_warning(LOG_FTP, "Write error %i occurred, closing client.", result);
+        goto recv_loop_end;
+    }
+    return true;
 
     recv_loop_end:
     cleanup_client(client);
+    return false;
+}
+
+static void watch_socket(s32 s, fd_set *set, s32 *nfds) {
+    FD_SET(s, set);
+    if (s >= *nfds) *nfds = s + 1;
+}
+
+/*
+    No more commands are read while replies are still waiting to be sent,
+    or while the line buffer is full of commands waiting for the current transfer to finish.
+*/
+static bool accepts_commands(client_t *client) {
+    return !queue_length(&client->replies) && client->offset < FTP_BUFFER_SIZE - 1;
+}
+
+/*
+    Returns the socket whose readiness drives the client's data connection, and the set it belongs in.
+    While waiting for a passive data connection this is the listening socket, for an active one
+    the connecting data socket, and during a transfer the data socket.
+    Returns -1 while a transfer is busy waiting on its file thread rather than on the network,
+    which wakes the main thread through the wakeup socket when it has done something.
+*/
+static s32 data_event_socket(client_t *client, fd_set *readset, fd_set *writeset, fd_set **set) {
+    if (client->data_connection_connected) {
+        *set = client->data_connection_receiving ? readset : writeset;
+        return client->data_connection_busy ? -1 : client->data_socket;
+    } else if (client->passive_socket >= 0) {
+        *set = readset;
+        return client->passive_socket;
+    } else {
+        *set = writeset;
+        return client->data_socket;
+    }
 }
 
-bool process_ftp_events(s32 server) {
-    bool network_down = !process_accept_events(server);
+/*
+    Waits until the server socket or any client socket is ready, or until the deadline (in ticks),
+    then services only the sockets that are ready and any data connections that have timed out.
+    Returns true if the network appears to be down.
+*/
+bool process_ftp_events(s32 server, u64 deadline) {
+    fd_set readset, writeset, *set;
+    FD_ZERO(&readset);
+    FD_ZERO(&writeset);
+    s32 nfds = 0;
+    watch_socket(server, &readset, &nfds);
+    s32 wakeup = wakeup_event_socket();
+    if (wakeup >= 0) watch_socket(wakeup, &readset, &nfds);
     int client_index;
-    for (client_index = 0; client_index < MAX_CLIENTS; client_index++) {
-        client_t *client = clients[client_index];
-        if (client) {
+    for (client_index = 0; client_index < max_clients; client_index++) {
+        client_t *client = client_slots + client_index;
+        if (client->in_use) {
+            if (queue_length(&client->replies)) watch_socket(client->socket, &writeset, &nfds);
+            if (accepts_commands(client)) watch_socket(client->socket, &readset, &nfds);
             if (client->data_callback) {
-                process_data_events(client);
-            } else {
+                s32 s = data_event_socket(client, &readset, &writeset, &set);
+                if (s >= 0) watch_socket(s, set, &nfds);
+                if (!client->data_connection_connected && client->data_connection_timer < deadline) {
+                    deadline = client->data_connection_timer;
+                }
+                if (client->data_connection_busy && wakeup < 0) {
+                    deadline = MIN(deadline, gettime() + millisecs_to_ticks(BUSY_POLL_INTERVAL_MS));
+                }
+            }
+        }
+    }
+
+    s32 result = net_select_until(nfds, &readset, &writeset, deadline);
+    if (result < 0) {
+        log_error(LOG_FTP, "Error waiting for network events: [%i] %s", -result, strerror(-result));
+        close_spare_passive_sockets();
+        return true;
+    }
+
+    if (wakeup >= 0 && FD_ISSET(wakeup, &readset)) drain_wakeups();
+    u64 now = gettime();
+    bool network_down = FD_ISSET(server, &readset) && !process_accept_events(server);
+    for (client_index = 0; client_index < max_clients; client_index++) {
+        client_t *client = client_slots + client_index;
+        if (client->in_use) {
+            if (queue_length(&client->replies) && FD_ISSET(client->socket, &writeset)) {
+                s32 result = queue_flush(client->socket, &client->replies);
+                if (result < 0 && result != -EAGAIN) {
+                    log_warning(LOG_FTP, "Write error %i occurred, closing client.", result);
+                    cleanup_client(client);
+                    continue;
+                }
+            }
+            // the data connection goes first, as finishing a transfer can run commands that were waiting for it
+            if (client->data_callback) {
+                s32 s = data_event_socket(client, &readset, &writeset, &set);
+                if (client->data_connection_busy || (s >= 0 && FD_ISSET(s, set)) ||
+                    (!client->data_connection_connected && now > client->data_connection_timer)) {
+                    if (!process_data_events(client)) continue;
+                }
+            }
+            if (FD_ISSET(client->socket, &readset)) {
                 process_control_events(client);
             }
         }
     }
+    if (network_down) {
+        close_spare_passive_sockets();
+    } else {
+        refill_passive_sockets();
+    }
     return network_down;
 }
@@ -26,9 +26,15 @@ misrepresented as being the original software.
 #ifndef _FTP_H_
 #define _FTP_H_
 
+#include "stats.h"
+
+void initialise_ftp(u32 memory_budget);
 void accept_ftp_client(s32 server);
 void set_ftp_password(char *new_password);
-bool process_ftp_events(s32 server);
+bool process_ftp_events(s32 server, u64 deadline);
+bool ftp_transfers_active();
+s32 write_sessions(stats_line_writer write, void *arg);
+s32 write_all_stats(stats_line_writer write, void *arg, bool machine);
 void cleanup_ftp();
 
 #endif /* _FTP_H_ */
@@ -33,14 +33,20 @@ misrepresented as being the original software.
 #include <string.h>
 #include <unistd.h>
 
+#include "blockcache.h"
 #include "ftp.h"
 #include "fs.h"
+#include "log.h"
 #include "net.h"
 #include "pad.h"
 #include "reset.h"
 
 static const u16 PORT = 21;
 static const char *APP_DIR_PREFIX = "ftpii_";
+static const u32 INPUT_POLL_INTERVAL_MS = 50;
+static const u32 SESSION_MEMORY_BUDGET = 24 * 1024;
+static const u32 CACHE_MEMORY_BUDGET = 512 * 1024;
+static const u32 BLOCKCACHE_MEMORY_BUDGET = 4 * 1024 * 1024;
 
 static void initialise_video() {
     VIDEO_Init();
@@ -61,12 +67,15 @@ static void initialise_video() {
 }
 
 static void initialise_ftpii() {
+    initialise_log();
     initialise_video();
     PAD_Init();
     initialise_reset_buttons();
     printf("To exit, hold A on controller #1 or press the reset button.\n");
     initialise_network();
-    initialise_fs();
+    initialise_fs(CACHE_MEMORY_BUDGET);
+    initialise_blockcache(BLOCKCACHE_MEMORY_BUDGET);
+    initialise_ftp(SESSION_MEMORY_BUDGET);
     printf("To remount a device, hold B on controller #1.\n");
 }
 
@@ -92,6 +101,15 @@ static void process_timer_events() {
     check_removable_devices(now);
 }
 
+/*
+    The controller and reset button are polled rather than signalled,
+    so never sleep in the network wait for longer than INPUT_POLL_INTERVAL_MS.
+*/
+static u64 next_timer_deadline() {
+    u64 deadline = gettime() + millisecs_to_ticks(INPUT_POLL_INTERVAL_MS);
+    return MIN(deadline, next_fs_timer());
+}
+
 int main(int argc, char **argv) {
     initialise_ftpii();
 
@@ -106,18 +124,25 @@ int main(int argc, char **argv) {
     while (!reset()) {
         if (network_down) {
             net_close(server);
+            close_wakeup();
             initialise_network();
             server = create_server(PORT);
             if (server < 0) continue;
             printf("Listening on TCP port %u...\n", PORT);
+            s32 wakeup = open_wakeup(PORT);
+            if (wakeup < 0) log_warning(LOG_FTP, "Unable to open a loopback wakeup socket: [%i] %s; polling transfers instead.", -wakeup, strerror(-wakeup));
             network_down = false;
         }
-        network_down = process_ftp_events(server);
+        network_down = process_ftp_events(server, next_timer_deadline());
+        // console output goes over the same EXI bus as the SD Gecko, so hold it back while data is moving
+        if (!ftp_transfers_active()) log_drain();
         process_gamecube_events();
         process_timer_events();
     }
     cleanup_ftp();
     net_close(server);
+    close_wakeup();
+    log_drain();
 
     u32 i;
     for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) unmount(VIRTUAL_PARTITIONS + i);
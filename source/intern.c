@@ -0,0 +1,99 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <malloc.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "intern.h"
+
+#define INTERN_BUCKETS 64
+
+/*
+    Reference-counted shared copies of strings, so that sessions sitting in the same directory
+    hold one copy of its path between them instead of a PATH_MAX array each.
+    Only the main thread may use these.
+*/
+typedef struct interned_struct {
+    struct interned_struct *next;
+    u32 hash;
+    u32 references;
+    char text[];
+} interned_t;
+
+static interned_t *buckets[INTERN_BUCKETS] = { NULL };
+
+static u32 hash_string(const char *s) {
+    u32 hash = 2166136261u;
+    for (; *s; s++) hash = (hash ^ (u8)*s) * 16777619u;
+    return hash;
+}
+
+static interned_t *entry_for(const char *s) {
+    return (interned_t *)(s - offsetof(interned_t, text));
+}
+
+/*
+    Returns a shared copy of s holding one reference, or NULL if out of memory.
+*/
+const char *intern_string(const char *s) {
+    u32 hash = hash_string(s);
+    interned_t **bucket = buckets + (hash % INTERN_BUCKETS);
+    interned_t *entry;
+    for (entry = *bucket; entry; entry = entry->next) {
+        if (entry->hash == hash && !strcmp(entry->text, s)) {
+            entry->references++;
+            return entry->text;
+        }
+    }
+    if (!(entry = malloc(sizeof(interned_t) + strlen(s) + 1))) return NULL;
+    entry->hash = hash;
+    entry->references = 1;
+    strcpy(entry->text, s);
+    entry->next = *bucket;
+    *bucket = entry;
+    return entry->text;
+}
+
+/*
+    Takes another reference to a string returned by intern_string.
+*/
+const char *retain_string(const char *s) {
+    entry_for(s)->references++;
+    return s;
+}
+
+/*
+    Drops a reference taken by intern_string or retain_string.  s may be NULL.
+*/
+void release_string(const char *s) {
+    if (!s) return;
+    interned_t *entry = entry_for(s);
+    if (--entry->references) return;
+    interned_t **link;
+    for (link = buckets + (entry->hash % INTERN_BUCKETS); *link != entry; link = &(*link)->next);
+    *link = entry->next;
+    free(entry);
+}
@@ -0,0 +1,137 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <stdio.h>
+#include <string.h>
+#include <sys/dirent.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "journal.h"
+
+/*
+    While a file is being uploaded, a sidecar next to it (".name.ftpii-part") holds how much of it is known to
+    be on the card, so that an upload cut off by a crash or a pulled card can be resumed from there.
+    The length is written at a fixed width, so that updating it never changes the sidecar's size
+    and journal_update can be called from a transfer thread without touching the directory cache.
+*/
+#define JOURNAL_SUFFIX ".ftpii-part"
+#define JOURNAL_RECORD_FORMAT "%020llu\n"
+#define JOURNAL_RECORD_LENGTH 21
+
+/*
+    Writes the real path of path's journal into buffer, which must hold PATH_MAX.
+*/
+static bool journal_path(const char *path, char *buffer) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || !slash[1]) return false;
+    u32 length = slash + 1 - path;
+    if (length + 1 + strlen(slash + 1) + strlen(JOURNAL_SUFFIX) >= PATH_MAX) return false;
+    memcpy(buffer, path, length);
+    sprintf(buffer + length, ".%s" JOURNAL_SUFFIX, slash + 1);
+    return true;
+}
+
+/*
+    Returns true and sets *length if path has a journal, i.e. an upload to it did not complete.
+*/
+bool journal_length(const char *path, u64 *length) {
+    char journal[PATH_MAX];
+    if (!journal_path(path, journal)) return false;
+    FILE *f = fopen(journal, "rb");
+    if (!f) return false;
+    unsigned long long value;
+    bool valid = fscanf(f, "%llu", &value) == 1;
+    fclose(f);
+    if (valid) *length = value;
+    return valid;
+}
+
+static bool write_record(const char *journal, const char *mode, u64 length) {
+    FILE *f = fopen(journal, mode);
+    if (!f) return false;
+    bool success = fprintf(f, JOURNAL_RECORD_FORMAT, (unsigned long long)length) == JOURNAL_RECORD_LENGTH;
+    if (fclose(f)) success = false;
+    return success;
+}
+
+/*
+    Whether name is that of a journal, which listings leave out.
+*/
+bool journal_file(const char *name) {
+    u32 length = strlen(name), suffix_length = strlen(JOURNAL_SUFFIX);
+    return *name == '.' && length > suffix_length + 1 && !strcasecmp(name + length - suffix_length, JOURNAL_SUFFIX);
+}
+
+/*
+    Records that length bytes of an upload to path are on the card, starting its journal.
+    Safe to call from a transfer thread, so the caller invalidates path in the directory cache once back on the main thread.
+*/
+bool journal_create(const char *path, u64 length) {
+    char journal[PATH_MAX];
+    if (!journal_path(path, journal)) return false;
+    return write_record(journal, "wb", length);
+}
+
+/*
+    Records that an upload to path is starting with length bytes of it already on the card.
+*/
+bool journal_begin(const char *path, u64 length) {
+    char journal[PATH_MAX];
+    if (!journal_path(path, journal)) return false;
+    bool success = write_record(journal, "wb", length);
+    dircache_invalidate(journal);
+    return success;
+}
+
+/*
+    Records that length bytes of path are on the card.  Safe to call from a transfer thread.
+*/
+bool journal_update(const char *path, u64 length) {
+    char journal[PATH_MAX];
+    if (!journal_path(path, journal)) return false;
+    return write_record(journal, "r+b", length);
+}
+
+/*
+    Forgets the journal of path, once an upload to it has completed or it has been deleted.
+*/
+void journal_end(const char *path) {
+    char journal[PATH_MAX];
+    if (!journal_path(path, journal)) return;
+    if (!unlink(journal)) dircache_invalidate(journal);
+}
+
+/*
+    Moves the journal of from_path, if any, along with the file.
+*/
+void journal_rename(const char *from_path, const char *to_path) {
+    char from_journal[PATH_MAX], to_journal[PATH_MAX];
+    if (!journal_path(from_path, from_journal) || !journal_path(to_path, to_journal)) return;
+    if (!rename(from_journal, to_journal)) {
+        dircache_invalidate(from_journal);
+        dircache_invalidate(to_journal);
+    }
+}
@@ -0,0 +1,45 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <gctypes.h>
+
+bool journal_file(const char *name);
+
+bool journal_length(const char *path, u64 *length);
+
+bool journal_create(const char *path, u64 length);
+
+bool journal_begin(const char *path, u64 length);
+
+bool journal_update(const char *path, u64 length);
+
+void journal_end(const char *path);
+
+void journal_rename(const char *from_path, const char *to_path);
+
+#endif /* _JOURNAL_H_ */
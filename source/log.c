@@ -0,0 +1,122 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+#define LOG_ENTRIES 64 // must be a power of two
+#define LOG_LINE_MAX 120
+
+/*
+    A bounded ring that any thread can log into without taking a lock, drained by the main thread.
+    An entry at position p is free for writing when its sequence is p, and holds a message once it is p + 1.
+    Writers claim a position by advancing head with compare-and-swap; when the ring is full the message is
+    dropped and counted rather than waiting for the console.
+*/
+typedef struct {
+    volatile u32 sequence;
+    char text[LOG_LINE_MAX];
+} log_entry_t;
+
+static log_entry_t ring[LOG_ENTRIES];
+static volatile u32 head = 0;
+static u32 tail = 0;
+static volatile u32 dropped = 0;
+
+static const char *level_names[] = { "error", "warning", "info", "debug" };
+static const char *subsystem_names[] = { "ftp", "data", "transfer", "fs" };
+static u8 levels[LOG_SUBSYSTEMS];
+
+void initialise_log() {
+    u32 i;
+    for (i = 0; i < LOG_ENTRIES; i++) ring[i].sequence = i;
+    for (i = 0; i < LOG_SUBSYSTEMS; i++) levels[i] = LOG_INFO;
+}
+
+void log_write(log_subsystem_t subsystem, log_level_t level, const char *format, ...) {
+    if (level > levels[subsystem]) return;
+    u32 position = head;
+    log_entry_t *entry;
+    for (;;) {
+        entry = ring + (position % LOG_ENTRIES);
+        s32 difference = (s32)(entry->sequence - position);
+        if (difference == 0 && __sync_bool_compare_and_swap(&head, position, position + 1)) {
+            break;
+        } else if (difference < 0) {
+            __sync_fetch_and_add(&dropped, 1);
+            return;
+        }
+        position = head;
+    }
+    va_list args;
+    va_start(args, format);
+    vsnprintf(entry->text, LOG_LINE_MAX, format, args);
+    va_end(args);
+    __sync_synchronize();
+    entry->sequence = position + 1;
+}
+
+static s32 find_name(const char **names, u32 count, const char *name) {
+    s32 i;
+    for (i = 0; i < count; i++) {
+        if (!strcasecmp(names[i], name)) return i;
+    }
+    return -1;
+}
+
+/*
+    An empty subsystem sets the level of every subsystem.
+*/
+bool set_log_level(const char *subsystem, const char *level) {
+    s32 level_index = find_name(level_names, LOG_DEBUG + 1, level);
+    s32 subsystem_index = *subsystem ? find_name(subsystem_names, LOG_SUBSYSTEMS, subsystem) : LOG_SUBSYSTEMS;
+    if (level_index < 0 || subsystem_index < 0) return false;
+    u32 i;
+    for (i = 0; i < LOG_SUBSYSTEMS; i++) {
+        if (subsystem_index == LOG_SUBSYSTEMS || subsystem_index == i) levels[i] = level_index;
+    }
+    return true;
+}
+
+/*
+    Writes every waiting message to the console (and so to the USB Gecko).
+    Only the main thread may call this.
+*/
+void log_drain() {
+    for (;;) {
+        log_entry_t *entry = ring + (tail % LOG_ENTRIES);
+        if (entry->sequence != tail + 1) break;
+        __sync_synchronize();
+        printf("%s\n", entry->text);
+        __sync_synchronize();
+        entry->sequence = tail + LOG_ENTRIES;
+        tail++;
+    }
+    u32 lost = __sync_fetch_and_and(&dropped, 0);
+    if (lost) printf("(%u log messages dropped)\n", lost);
+}
@@ -0,0 +1,57 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <gctypes.h>
+
+typedef enum { LOG_ERROR, LOG_WARNING, LOG_INFO, LOG_DEBUG } log_level_t;
+
+typedef enum { LOG_FTP, LOG_DATA, LOG_TRANSFER, LOG_FS, LOG_SUBSYSTEMS } log_subsystem_t;
+
+/*
+    Messages above LOG_MAX_LEVEL compile to nothing, arguments included.
+    Build with -DLOG_MAX_LEVEL=LOG_DEBUG to trace every command, reply and data connection.
+*/
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_INFO
+#endif
+
+#define log_message(subsystem, level, ...) do { if ((level) <= LOG_MAX_LEVEL) log_write(subsystem, level, __VA_ARGS__); } while (0)
+#define log_error(subsystem, ...) log_message(subsystem, LOG_ERROR, __VA_ARGS__)
+#define log_warning(subsystem, ...) log_message(subsystem, LOG_WARNING, __VA_ARGS__)
+#define log_info(subsystem, ...) log_message(subsystem, LOG_INFO, __VA_ARGS__)
+#define log_debug(subsystem, ...) log_message(subsystem, LOG_DEBUG, __VA_ARGS__)
+
+void initialise_log();
+
+void log_write(log_subsystem_t subsystem, log_level_t level, const char *format, ...) __attribute__ ((format (printf, 3, 4)));
+
+bool set_log_level(const char *subsystem, const char *level);
+
+void log_drain();
+
+#endif /* _LOG_H_ */
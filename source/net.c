@@ -24,18 +24,31 @@ misrepresented as being the original software.
 #include <errno.h>
 #include <gccore.h>
 #include <network.h>
+#include <ogc/lwp_watchdog.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/fcntl.h>
 
+#include "log.h"
 #include "net.h"
 #include "reset.h"
 
 #define MAX_NET_BUFFER_SIZE 32768
 #define MIN_NET_BUFFER_SIZE 4096
-#define FREAD_BUFFER_SIZE 32768
+#define CHUNK_PROBE_STREAK 4
+#define CHUNK_RETRY_STREAK 64
+#define MIN_QUEUE_SIZE 1024
+#define MAX_QUEUE_SIZE 65536
+#define WAKEUP_CHECK_MS 100
 
-static u32 NET_BUFFER_SIZE = MAX_NET_BUFFER_SIZE;
+/*
+    A UDP socket on the loopback interface that sends to itself, so that other threads can end the main thread's wait
+    in net_select.  Written from those threads, so it is only opened and closed with wakeup_lock held.
+*/
+static s32 wakeup_socket = -1;
+static mutex_t wakeup_lock;
+static bool wakeup_lock_ready = false;
 
 void initialise_network() {
     struct in_addr s_addr = {0};
@@ -63,11 +76,20 @@ void initialise_network() {
 }
 
 s32 set_blocking(s32 s, bool blocking) {
-    s32 flags = blocking;
+    s32 flags = !blocking;
     net_ioctl(s, FIONBIO, &flags);
     return flags;
 }
 
+/*
+    Replies and listings are already gathered into whole writes by hand, so Nagle's algorithm would only hold
+    the last small write back until the client's delayed ACK of the one before, e.g. a 226 behind its 150.
+*/
+s32 set_nodelay(s32 s) {
+    u32 one = 1;
+    return net_setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
 s32 net_close_blocking(s32 s) {
     set_blocking(s, true);
     return net_close(s);
@@ -99,88 +121,258 @@ s32 create_server(u16 port) {
     return server;
 }
 
-typedef s32 (*transferrer_type)(s32 s, void *mem, s32 len);
-static s32 transfer_exact(s32 s, char *buf, s32 length, transferrer_type transferrer) {
-    s32 result = 0;
-    s32 remaining = length;
-    s32 bytes_transferred;
-    set_blocking(s, true);
-    while (remaining) {
-        try_again_with_smaller_buffer:
-        bytes_transferred = transferrer(s, buf, MIN(remaining, NET_BUFFER_SIZE));
-        if (bytes_transferred > 0) {
-            remaining -= bytes_transferred;
-            buf += bytes_transferred;
-        } else if (bytes_transferred < 0) {
-            if (bytes_transferred == -EINVAL && NET_BUFFER_SIZE == MAX_NET_BUFFER_SIZE) {
-                NET_BUFFER_SIZE = MIN_NET_BUFFER_SIZE;
-                goto try_again_with_smaller_buffer;
-            }
-            result = bytes_transferred;
-            break;
-        } else {
-            result = -ENODATA;
-            break;
-        }
-    }
+/*
+    Opens the wakeup socket on port, once a byte sent through it has been seen to arrive.
+    Returns the socket, or a negative error if the stack can't deliver to itself, in which case
+    the main thread has to poll for what other threads have done.
+*/
+s32 open_wakeup(u16 port) {
+    if (!wakeup_lock_ready && LWP_MutexInit(&wakeup_lock, false) < 0) return -ENOMEM;
+    wakeup_lock_ready = true;
+    s32 s = net_socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (s < 0) return s;
     set_blocking(s, false);
-    return result;
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    s32 ret;
+    char byte = 0;
+    fd_set readset, writeset;
+    FD_ZERO(&readset);
+    FD_ZERO(&writeset);
+    FD_SET(s, &readset);
+    if ((ret = net_bind(s, (struct sockaddr *)&address, sizeof(address))) < 0 ||
+        (ret = net_connect(s, (struct sockaddr *)&address, sizeof(address))) < 0 ||
+        (ret = net_write(s, &byte, 1)) < 0 ||
+        (ret = net_select_until(s + 1, &readset, &writeset, gettime() + millisecs_to_ticks(WAKEUP_CHECK_MS))) <= 0) {
+        net_close(s);
+        return ret < 0 ? ret : -ETIMEDOUT;
+    }
+    LWP_MutexLock(wakeup_lock);
+    wakeup_socket = s;
+    LWP_MutexUnlock(wakeup_lock);
+    drain_wakeups();
+    return s;
 }
 
-s32 send_exact(s32 s, char *buf, s32 length) {
-    return transfer_exact(s, buf, length, (transferrer_type)net_write);
+void close_wakeup() {
+    if (!wakeup_lock_ready) return;
+    LWP_MutexLock(wakeup_lock);
+    if (wakeup_socket >= 0) net_close(wakeup_socket);
+    wakeup_socket = -1;
+    LWP_MutexUnlock(wakeup_lock);
 }
 
-s32 send_from_file(s32 s, FILE *f) {
-    char buf[FREAD_BUFFER_SIZE];
-    s32 bytes_read;
-    s32 result = 0;
+/*
+    The wakeup socket for the main thread to wait on, or -1 if there is none.
+*/
+s32 wakeup_event_socket() {
+    return wakeup_socket;
+}
 
-    bytes_read = fread(buf, 1, FREAD_BUFFER_SIZE, f);
-    if (bytes_read > 0) {
-        result = send_exact(s, buf, bytes_read);
-        if (result < 0) goto end;
+/*
+    Called from any thread.
+*/
+void wake_main_thread() {
+    if (!wakeup_lock_ready) return;
+    LWP_MutexLock(wakeup_lock);
+    char byte = 0;
+    if (wakeup_socket >= 0) net_write(wakeup_socket, &byte, 1);
+    LWP_MutexUnlock(wakeup_lock);
+}
+
+/*
+    Reads every pending wakeup, before the main thread looks at what woke it.
+*/
+void drain_wakeups() {
+    char bytes[16];
+    while (wakeup_socket >= 0 && net_read(wakeup_socket, bytes, sizeof(bytes)) > 0);
+}
+
+void queue_init(output_queue_t *queue) {
+    queue->buf = NULL;
+    queue->capacity = 0;
+    queue->start = 0;
+    queue->end = 0;
+    chunk_sizer_init(&queue->sizer);
+}
+
+void queue_free(output_queue_t *queue) {
+    free(queue->buf);
+    queue_init(queue);
+}
+
+u32 queue_length(output_queue_t *queue) {
+    return queue->end - queue->start;
+}
+
+/*
+    Returns a pointer to at least length bytes of contiguous free space at the end of the queue,
+    compacting or growing the buffer as required.  Returns NULL if the queue would exceed MAX_QUEUE_SIZE.
+    Follow with queue_commit to append the bytes that were actually written there.
+*/
+char *queue_reserve(output_queue_t *queue, u32 length) {
+    if (queue->capacity - queue->end >= length) return queue->buf + queue->end;
+    u32 pending = queue_length(queue);
+    if (pending + length > MAX_QUEUE_SIZE) return NULL;
+    if (queue->capacity >= pending + length) {
+        memmove(queue->buf, queue->buf + queue->start, pending);
+    } else {
+        u32 capacity = queue->capacity ? queue->capacity : MIN_QUEUE_SIZE;
+        while (capacity < pending + length) capacity *= 2;
+        char *buf = malloc(capacity);
+        if (!buf) return NULL;
+        memcpy(buf, queue->buf + queue->start, pending);
+        free(queue->buf);
+        queue->buf = buf;
+        queue->capacity = capacity;
     }
-    if (bytes_read < FREAD_BUFFER_SIZE) {
-        result = -!feof(f);
-        goto end;
+    queue->start = 0;
+    queue->end = pending;
+    return queue->buf + queue->end;
+}
+
+void queue_commit(output_queue_t *queue, u32 length) {
+    queue->end += length;
+}
+
+s32 queue_append(output_queue_t *queue, const char *data, u32 length) {
+    char *dest = queue_reserve(queue, length);
+    if (!dest) return -ENOMEM;
+    memcpy(dest, data, length);
+    queue_commit(queue, length);
+    return 0;
+}
+
+void chunk_sizer_init(chunk_sizer_t *sizer) {
+    sizer->size = MIN_NET_BUFFER_SIZE;
+    sizer->ceiling = MAX_NET_BUFFER_SIZE;
+    sizer->streak = 0;
+    sizer->peak = 0;
+    sizer->fallbacks = 0;
+    sizer->backoffs = 0;
+}
+
+/*
+    Logs where a connection's chunk size ended up, unless it never sent a full chunk or backed off.
+*/
+void log_chunk_sizer(log_subsystem_t subsystem, const char *connection, chunk_sizer_t *sizer) {
+    if (!sizer->peak && !sizer->fallbacks && !sizer->backoffs) return;
+    log_info(subsystem, "%s chunk size settled at %u bytes (peak %u, ceiling %u) after %u fallbacks and %u backoffs.",
+        connection, sizer->size, sizer->peak, sizer->ceiling, sizer->fallbacks, sizer->backoffs);
+}
+
+/*
+    A full-sized chunk went through.  Step up to twice the size after CHUNK_PROBE_STREAK of those,
+    and every CHUNK_RETRY_STREAK at the ceiling, try raising a ceiling that an earlier error lowered.
+*/
+static void chunk_succeeded(chunk_sizer_t *sizer) {
+    if (sizer->size > sizer->peak) sizer->peak = sizer->size;
+    sizer->streak++;
+    if (sizer->size < sizer->ceiling && sizer->streak >= CHUNK_PROBE_STREAK) {
+        sizer->size *= 2;
+        sizer->streak = 0;
+    } else if (sizer->ceiling < MAX_NET_BUFFER_SIZE && sizer->streak >= CHUNK_RETRY_STREAK) {
+        sizer->ceiling *= 2;
+        sizer->streak = 0;
     }
-    return -EAGAIN;
-    end:
-    return result;
 }
 
-s32 recv_to_file(s32 s, FILE *f) {
-    char buf[NET_BUFFER_SIZE];
-    s32 bytes_read;
-    while (1) {
-        try_again_with_smaller_buffer:
-        bytes_read = net_read(s, buf, NET_BUFFER_SIZE);
-        if (bytes_read < 0) {
-            if (bytes_read == -EINVAL && NET_BUFFER_SIZE == MAX_NET_BUFFER_SIZE) {
-                NET_BUFFER_SIZE = MIN_NET_BUFFER_SIZE;
-                goto try_again_with_smaller_buffer;
+/*
+    The stack refused a chunk of this size (-EINVAL), so never go this big again until the ceiling is retried.
+    Returns false if the size is already as small as it gets.
+*/
+static bool chunk_failed(chunk_sizer_t *sizer) {
+    if (sizer->size <= MIN_NET_BUFFER_SIZE) return false;
+    sizer->size /= 2;
+    sizer->ceiling = sizer->size;
+    sizer->streak = 0;
+    sizer->fallbacks++;
+    return true;
+}
+
+/*
+    The socket only took part of a chunk, so back off a step without lowering the ceiling.
+*/
+static void chunk_truncated(chunk_sizer_t *sizer) {
+    if (sizer->size > MIN_NET_BUFFER_SIZE) sizer->size /= 2;
+    sizer->streak = 0;
+    sizer->backoffs++;
+}
+
+/*
+    Writes as much of buf as the socket will take without blocking, in chunks sized by sizer.
+    Returns the number of bytes written, which may be 0, or a negative error.
+*/
+s32 send_nonblocking(s32 s, chunk_sizer_t *sizer, char *buf, s32 length) {
+    s32 sent = 0;
+    while (sent < length) {
+        s32 chunk = MIN(length - sent, sizer->size);
+        s32 bytes_written = net_write(s, buf + sent, chunk);
+        if (bytes_written > 0) {
+            sent += bytes_written;
+            if (bytes_written < chunk) {
+                chunk_truncated(sizer);
+                break;
+            } else if (chunk == sizer->size) {
+                chunk_succeeded(sizer);
             }
-            return bytes_read;
-        } else if (bytes_read == 0) {
-            return 0;
+        } else if (bytes_written == -EAGAIN) {
+            break;
+        } else if (bytes_written == -EINVAL && chunk_failed(sizer)) {
+            continue;
+        } else if (bytes_written < 0) {
+            return bytes_written;
+        } else {
+            return -ENODATA;
         }
-
-        s32 bytes_written = fwrite(buf, 1, bytes_read, f);
-        if (bytes_written < bytes_read) return -1;
     }
+    return sent;
 }
 
-s32 net_accept_nonblocking(s32 s, struct sockaddr *addr, socklen_t *addrlen) {
-    struct timeval tv = {0};
-    fd_set readset;
-    FD_ZERO(&readset);
-    FD_SET(s, &readset);
-    net_select(FD_SETSIZE, &readset, NULL, NULL, &tv);
+/*
+    Writes as much of the queue as the socket will take without blocking.
+    Returns 0 once the queue is empty, -EAGAIN if some of it had to be left for later, or another negative error.
+*/
+s32 queue_flush(s32 s, output_queue_t *queue) {
+    s32 result = send_nonblocking(s, &queue->sizer, queue->buf + queue->start, queue_length(queue));
+    if (result < 0) return result;
+    queue->start += result;
+    if (queue_length(queue)) return -EAGAIN;
+    queue->start = queue->end = 0;
+    return 0;
+}
 
-    if (FD_ISSET(s, &readset)) {
-        return net_accept(s, addr, addrlen);
-    } else {
-        return -EAGAIN;
+/*
+    Reads whatever is available without blocking, in a chunk sized by sizer.
+    Short reads are normal here, so only errors make the size back off.
+    Returns the number of bytes read, 0 at end of stream, -EAGAIN if nothing is available yet, or another negative error.
+*/
+s32 recv_nonblocking(s32 s, chunk_sizer_t *sizer, char *buf, s32 length) {
+    s32 bytes_read;
+    while ((bytes_read = net_read(s, buf, MIN(length, sizer->size))) == -EINVAL && chunk_failed(sizer));
+    if (bytes_read > 0 && length >= sizer->size) chunk_succeeded(sizer);
+    return bytes_read;
+}
+
+/*
+    Waits until one of the sockets in readset or writeset is ready, or until the deadline (in ticks) passes.
+    On return the sets contain only the ready sockets; both are cleared on timeout or error.
+*/
+s32 net_select_until(s32 nfds, fd_set *readset, fd_set *writeset, u64 deadline) {
+    u64 now = gettime();
+    u64 wait = deadline > now ? ticks_to_microsecs(deadline - now) : 0;
+    struct timeval tv;
+    tv.tv_sec = wait / 1000000;
+    tv.tv_usec = wait % 1000000;
+    s32 result = net_select(nfds, readset, writeset, NULL, &tv);
+    if (result <= 0) {
+        FD_ZERO(readset);
+        FD_ZERO(writeset);
     }
+    return result == -EINTR ? 0 : result;
 }
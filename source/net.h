@@ -24,22 +24,79 @@ misrepresented as being the original software.
 #ifndef _NET_H_
 #define _NET_H_
 
+#include <network.h>
 #include <stdio.h>
 
+#include "log.h"
+
+/*
+    Per-connection transfer chunk size, probed upwards on success and backed off on errors and short writes.
+    ceiling is the largest size not known to fail, peak the largest size that has succeeded,
+    fallbacks counts errors that lowered the ceiling and backoffs counts short writes.
+*/
+typedef struct {
+    u32 size;
+    u32 ceiling;
+    u32 streak;
+    u32 peak;
+    u32 fallbacks;
+    u32 backoffs;
+} chunk_sizer_t;
+
+/*
+    Bytes waiting to be written to a non-blocking socket.
+    Pending data lives in buf[start..end).
+*/
+typedef struct {
+    char *buf;
+    u32 capacity;
+    u32 start;
+    u32 end;
+    chunk_sizer_t sizer;
+} output_queue_t;
+
 void initialise_network();
 
 s32 set_blocking(s32 s, bool blocking);
 
+s32 set_nodelay(s32 s);
+
 s32 net_close_blocking(s32 s);
 
 s32 create_server(u16 port);
 
-s32 send_exact(s32 s, char *buf, s32 length);
+s32 open_wakeup(u16 port);
+
+void close_wakeup();
+
+s32 wakeup_event_socket();
+
+void wake_main_thread();
+
+void drain_wakeups();
+
+void chunk_sizer_init(chunk_sizer_t *sizer);
+
+void log_chunk_sizer(log_subsystem_t subsystem, const char *connection, chunk_sizer_t *sizer);
+
+void queue_init(output_queue_t *queue);
+
+void queue_free(output_queue_t *queue);
+
+u32 queue_length(output_queue_t *queue);
+
+char *queue_reserve(output_queue_t *queue, u32 length);
+
+void queue_commit(output_queue_t *queue, u32 length);
+
+s32 queue_append(output_queue_t *queue, const char *data, u32 length);
+
+s32 send_nonblocking(s32 s, chunk_sizer_t *sizer, char *buf, s32 length);
 
-s32 send_from_file(s32 s, FILE *f);
+s32 queue_flush(s32 s, output_queue_t *queue);
 
-s32 recv_to_file(s32 s, FILE *f);
+s32 recv_nonblocking(s32 s, chunk_sizer_t *sizer, char *buf, s32 length);
 
-s32 net_accept_nonblocking(s32 s, struct sockaddr *addr, socklen_t *addrlen);
+s32 net_select_until(s32 nfds, fd_set *readset, fd_set *writeset, u64 deadline);
 
 #endif /* _NET_H_ */
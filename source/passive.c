@@ -0,0 +1,140 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <network.h>
+#include <string.h>
+
+#include "net.h"
+#include "passive.h"
+
+#define PASSIVE_PORT_FIRST 1024
+#define PASSIVE_PORTS 64
+
+/*
+    Passive ports come from a fixed range, handed out least recently used first so that a port
+    is unlikely to be reused while it is still in TIME_WAIT.  free_ports is a FIFO of the ports that
+    are neither in use nor held by one of the spare sockets, which are kept bound and listening
+    so that PASV and EPSV can reply without waiting for a bind.
+*/
+static u16 free_ports[PASSIVE_PORTS];
+static u32 free_head = 0;
+static u32 free_count = 0;
+
+static s32 spare_sockets[PASSIVE_SPARES];
+static u16 spare_ports[PASSIVE_SPARES];
+static u32 num_spares = 0;
+
+void initialise_passive_ports() {
+    for (free_count = 0; free_count < PASSIVE_PORTS; free_count++) {
+        free_ports[free_count] = PASSIVE_PORT_FIRST + free_count;
+    }
+    free_head = 0;
+}
+
+static u16 pop_port() {
+    u16 port = free_ports[free_head];
+    free_head = (free_head + 1) % PASSIVE_PORTS;
+    free_count--;
+    return port;
+}
+
+static void push_port(u16 port) {
+    free_ports[(free_head + free_count) % PASSIVE_PORTS] = port;
+    free_count++;
+}
+
+static s32 listen_on_port(u16 port) {
+    s32 s = net_socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (s < 0) return s;
+    set_blocking(s, false);
+    struct sockaddr_in bindAddress;
+    memset(&bindAddress, 0, sizeof(bindAddress));
+    bindAddress.sin_family = AF_INET;
+    bindAddress.sin_port = htons(port);
+    bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    s32 result;
+    if ((result = net_bind(s, (struct sockaddr *)&bindAddress, sizeof(bindAddress))) < 0 || (result = net_listen(s, 1)) < 0) {
+        net_close(s);
+        return result;
+    }
+    return s;
+}
+
+/*
+    Ports that fail to bind go to the back of the queue, to be tried again once they have had time to clear.
+*/
+static s32 listen_on_free_port(u16 *port) {
+    s32 result = -EADDRINUSE;
+    u32 attempts;
+    for (attempts = free_count; attempts; attempts--) {
+        u16 candidate = pop_port();
+        if ((result = listen_on_port(candidate)) >= 0) {
+            *port = candidate;
+            return result;
+        }
+        push_port(candidate);
+        if (result != -EADDRINUSE) break;
+    }
+    return result;
+}
+
+/*
+    Returns a non-blocking socket listening on *port, or a negative error.
+*/
+s32 acquire_passive_socket(u16 *port) {
+    if (num_spares) {
+        num_spares--;
+        *port = spare_ports[num_spares];
+        return spare_sockets[num_spares];
+    }
+    return listen_on_free_port(port);
+}
+
+void release_passive_socket(s32 s, u16 port) {
+    net_close_blocking(s);
+    push_port(port);
+}
+
+/*
+    Tops the spare sockets back up, outside of any command's reply path.
+*/
+void refill_passive_sockets() {
+    while (num_spares < PASSIVE_SPARES) {
+        u16 port;
+        s32 s = listen_on_free_port(&port);
+        if (s < 0) break;
+        spare_sockets[num_spares] = s;
+        spare_ports[num_spares] = port;
+        num_spares++;
+    }
+}
+
+void close_spare_passive_sockets() {
+    while (num_spares) {
+        num_spares--;
+        release_passive_socket(spare_sockets[num_spares], spare_ports[num_spares]);
+    }
+}
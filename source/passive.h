@@ -0,0 +1,43 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _PASSIVE_H_
+#define _PASSIVE_H_
+
+#include <gctypes.h>
+
+#define PASSIVE_SPARES 2 // bound and listening ahead of PASV and EPSV
+
+void initialise_passive_ports();
+
+s32 acquire_passive_socket(u16 *port);
+
+void release_passive_socket(s32 s, u16 port);
+
+void refill_passive_sockets();
+
+void close_spare_passive_sockets();
+
+#endif /* _PASSIVE_H_ */
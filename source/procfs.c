@@ -0,0 +1,197 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "blockcache.h"
+#include "dircache.h"
+#include "fs.h"
+#include "ftp.h"
+#include "procfs.h"
+#include "shared_file.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+    A read-only tree of synthetic files at /ftpii, with real paths under PROCFS_PREFIX.
+    Each file is generated afresh whenever it is opened or stat'ed, so it always reflects the live state.
+*/
+typedef struct {
+    char *data;
+    u32 length;
+    u32 capacity;
+} procfs_buffer_t;
+
+static bool reserve(procfs_buffer_t *buffer, u32 length) {
+    if (buffer->length + length <= buffer->capacity) return true;
+    u32 capacity = buffer->capacity ? buffer->capacity : 1024;
+    while (capacity < buffer->length + length) capacity *= 2;
+    char *data = realloc(buffer->data, capacity);
+    if (!data) return false;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+static s32 append_line(void *arg, const char *line) {
+    procfs_buffer_t *buffer = arg;
+    u32 length = strlen(line);
+    if (!reserve(buffer, length + 1)) return -ENOMEM;
+    memcpy(buffer->data + buffer->length, line, length);
+    buffer->data[buffer->length + length] = '\n';
+    buffer->length += length + 1;
+    return 0;
+}
+
+static s32 generate_sessions(procfs_buffer_t *buffer) {
+    return write_sessions(append_line, buffer);
+}
+
+static s32 generate_mounts(procfs_buffer_t *buffer) {
+    return write_mounts(append_line, buffer);
+}
+
+static s32 generate_dircache(procfs_buffer_t *buffer) {
+    return dircache_write_state(append_line, buffer);
+}
+
+static s32 generate_blockcache(procfs_buffer_t *buffer) {
+    return blockcache_write_state(append_line, buffer);
+}
+
+static s32 generate_files(procfs_buffer_t *buffer) {
+    return shared_file_write_state(append_line, buffer);
+}
+
+static s32 generate_stats(procfs_buffer_t *buffer) {
+    return write_all_stats(append_line, buffer, false);
+}
+
+static s32 generate_raw_stats(procfs_buffer_t *buffer) {
+    return write_all_stats(append_line, buffer, true);
+}
+
+static s32 generate_trace(procfs_buffer_t *buffer) {
+    trace_header_t header = { { 'F', 'T', 'R', 'C' }, 1, sizeof(trace_event_t), 0 };
+    if (!reserve(buffer, sizeof(header) + TRACE_MAX_EVENTS * sizeof(trace_event_t))) return -ENOMEM;
+    header.count = trace_snapshot((trace_event_t *)(buffer->data + sizeof(header)), TRACE_MAX_EVENTS);
+    memcpy(buffer->data, &header, sizeof(header));
+    buffer->length = sizeof(header) + header.count * sizeof(trace_event_t);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    s32 (*generate)(procfs_buffer_t *buffer);
+} files[] = {
+    { "sessions", generate_sessions },
+    { "mounts", generate_mounts },
+    { "dircache", generate_dircache },
+    { "blockcache", generate_blockcache },
+    { "files", generate_files },
+    { "stats", generate_stats },
+    { "stats.raw", generate_raw_stats },
+    { "trace", generate_trace },
+};
+static const u32 NUM_FILES = sizeof(files) / sizeof(*files);
+
+bool procfs_path(const char *real_path) {
+    return !strncmp(real_path, PROCFS_PREFIX, strlen(PROCFS_PREFIX));
+}
+
+/*
+    Returns the index of the file at real_path, NUM_FILES for the directory itself, or -1 with errno set.
+*/
+static s32 find_file(const char *real_path) {
+    const char *name = real_path + strlen(PROCFS_PREFIX);
+    if (!*name) return NUM_FILES;
+    u32 i;
+    for (i = 0; i < NUM_FILES; i++) {
+        if (!strcmp(files[i].name, name)) return i;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+static s32 generate(u32 index, procfs_buffer_t *buffer) {
+    memset(buffer, 0, sizeof(procfs_buffer_t));
+    s32 result = files[index].generate(buffer);
+    if (result < 0) {
+        free(buffer->data);
+        errno = -result;
+    }
+    return result;
+}
+
+int procfs_stat(const char *real_path, struct stat *st) {
+    s32 index = find_file(real_path);
+    if (index < 0) return -1;
+    memset(st, 0, sizeof(struct stat));
+    st->st_mtime = time(NULL);
+    if (index == NUM_FILES) {
+        st->st_mode = S_IFDIR | 0555;
+        return 0;
+    }
+    procfs_buffer_t buffer;
+    if (generate(index, &buffer) < 0) return -1;
+    st->st_mode = S_IFREG | 0444;
+    st->st_size = buffer.length;
+    free(buffer.data);
+    return 0;
+}
+
+/*
+    Opens a snapshot of the file for reading, as a memory stream which owns its copy of the contents.
+*/
+FILE *procfs_fopen(const char *real_path) {
+    s32 index = find_file(real_path);
+    if (index < 0) return NULL;
+    if (index == NUM_FILES) {
+        errno = EISDIR;
+        return NULL;
+    }
+    procfs_buffer_t buffer;
+    if (generate(index, &buffer) < 0) return NULL;
+    FILE *f = fmemopen(NULL, buffer.length + 1, "w+"); // room for the terminator a memory stream may write
+    if (f && (fwrite(buffer.data, 1, buffer.length, f) < buffer.length || fseek(f, 0, SEEK_SET))) {
+        fclose(f);
+        f = NULL;
+        errno = ENOMEM;
+    }
+    free(buffer.data);
+    return f;
+}
+
+/*
+    Returns the name of the index'th file, or NULL past the last one.
+*/
+const char *procfs_entry(u32 index) {
+    return index < NUM_FILES ? files[index].name : NULL;
+}
@@ -0,0 +1,44 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _PROCFS_H_
+#define _PROCFS_H_
+
+#include <gctypes.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define PROCFS_ALIAS "/ftpii"
+#define PROCFS_PREFIX "ftpii:/"
+
+bool procfs_path(const char *real_path);
+
+int procfs_stat(const char *real_path, struct stat *st);
+
+FILE *procfs_fopen(const char *real_path);
+
+const char *procfs_entry(u32 index);
+
+#endif /* _PROCFS_H_ */
@@ -28,6 +28,7 @@ misrepresented as being the original software.
 #include <ogc/system.h>
 #include <ogc/video.h>
 
+#include "log.h"
 #include "pad.h"
 #include "reset.h"
 
@@ -55,6 +56,7 @@ void maybe_poweroff() {
 }
 
 void die(char *msg, int errnum) {
+    log_drain();
     printf("%s: [%i] %s\n", msg, errnum, strerror(errnum));
     printf("Program halted.  Press reset to exit.\n");
     while (!check_reset_synchronous()) VIDEO_WaitVSync();
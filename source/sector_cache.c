@@ -0,0 +1,149 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sector_cache.h"
+
+static u8 *page_data(sector_cache_t *cache, cache_page_t *page) {
+    return cache->data + (page - cache->pages) * cache->geometry.sectors_per_page * SECTOR_SIZE;
+}
+
+/*
+    Allocates the pages for geometry, dropping anything cached before.  A geometry of no pages,
+    or one that can't be allocated, leaves the cache passing every request straight through.
+*/
+bool sector_cache_init(sector_cache_t *cache, cache_geometry_t geometry) {
+    sector_cache_free(cache);
+    if (!geometry.pages || !geometry.sectors_per_page) return true;
+    cache->pages = calloc(geometry.pages, sizeof(cache_page_t));
+    cache->data = memalign(32, geometry.pages * geometry.sectors_per_page * SECTOR_SIZE);
+    if (!cache->pages || !cache->data) {
+        sector_cache_free(cache);
+        return false;
+    }
+    cache->geometry = geometry;
+    cache->clock = 0;
+    return true;
+}
+
+void sector_cache_free(sector_cache_t *cache) {
+    free(cache->pages);
+    free(cache->data);
+    cache->pages = NULL;
+    cache->data = NULL;
+    cache->geometry.pages = 0;
+    cache->geometry.sectors_per_page = 0;
+}
+
+static cache_page_t *find_page(sector_cache_t *cache, sec_t sector) {
+    u32 i;
+    for (i = 0; i < cache->geometry.pages; i++) {
+        cache_page_t *page = cache->pages + i;
+        if (page->count && sector >= page->sector && sector - page->sector < page->count) return page;
+    }
+    return NULL;
+}
+
+/*
+    Reads the page holding sector into the least recently used slot.
+    If the whole page can't be read, e.g. at the end of the device, only sector itself is cached.
+*/
+static cache_page_t *fill_page(sector_cache_t *cache, sec_t sector) {
+    cache_page_t *victim = cache->pages;
+    u32 i;
+    for (i = 1; i < cache->geometry.pages && victim->count; i++) {
+        cache_page_t *page = cache->pages + i;
+        if (!page->count || page->last_used < victim->last_used) victim = page;
+    }
+    if (victim->count) cache->stats.evictions++;
+    victim->count = 0;
+
+    u32 sectors_per_page = cache->geometry.sectors_per_page;
+    sec_t first = sector - sector % sectors_per_page;
+    if (cache->read(cache->arg, first, sectors_per_page, page_data(cache, victim))) {
+        victim->sector = first;
+        victim->count = sectors_per_page;
+    } else if (cache->read(cache->arg, sector, 1, page_data(cache, victim))) {
+        victim->sector = sector;
+        victim->count = 1;
+    } else {
+        return NULL;
+    }
+    return victim;
+}
+
+bool sector_cache_read(sector_cache_t *cache, sec_t sector, sec_t count, void *buffer) {
+    cache->stats.requests++;
+    cache->stats.requested_sectors += count;
+    if (!cache->pages || count > cache->geometry.sectors_per_page) {
+        cache->stats.bypasses++;
+        return cache->read(cache->arg, sector, count, buffer);
+    }
+
+    u8 *out = buffer;
+    while (count) {
+        cache_page_t *page = find_page(cache, sector);
+        if (page) {
+            cache->stats.hits++;
+        } else {
+            cache->stats.misses++;
+            if (!(page = fill_page(cache, sector))) return false;
+        }
+        page->last_used = ++cache->clock;
+        u32 offset = sector - page->sector;
+        u32 sectors = MIN(count, page->count - offset);
+        memcpy(out, page_data(cache, page) + offset * SECTOR_SIZE, sectors * SECTOR_SIZE);
+        out += sectors * SECTOR_SIZE;
+        sector += sectors;
+        count -= sectors;
+    }
+    return true;
+}
+
+/*
+    Writes go straight to the device.  Cached copies of the sectors are updated if it succeeds
+    and dropped if it fails, since the device may then hold either version.
+*/
+bool sector_cache_write(sector_cache_t *cache, sec_t sector, sec_t count, const void *buffer) {
+    bool success = cache->write(cache->arg, sector, count, buffer);
+    u32 i;
+    for (i = 0; i < cache->geometry.pages; i++) {
+        cache_page_t *page = cache->pages + i;
+        if (!page->count) continue;
+        sec_t first = MAX(sector, page->sector);
+        sec_t end = MIN(sector + count, page->sector + page->count);
+        if (first >= end) continue;
+        if (!success) {
+            page->count = 0;
+            continue;
+        }
+        memcpy(page_data(cache, page) + (first - page->sector) * SECTOR_SIZE,
+            (const u8 *)buffer + (first - sector) * SECTOR_SIZE, (end - first) * SECTOR_SIZE);
+    }
+    return success;
+}
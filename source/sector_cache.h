@@ -0,0 +1,80 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _SECTOR_CACHE_H_
+#define _SECTOR_CACHE_H_
+
+#include <ogc/disc_io.h>
+
+#define SECTOR_SIZE 512
+
+typedef struct {
+    u32 pages;
+    u32 sectors_per_page;
+} cache_geometry_t;
+
+/*
+    requests and requested_sectors describe the reads libfat asked for, whatever served them.
+    A request touching several pages counts one hit or miss per page; requests of a page or more bypass the cache.
+*/
+typedef struct {
+    u64 requests;
+    u64 requested_sectors;
+    u64 hits;
+    u64 misses;
+    u64 bypasses;
+    u64 evictions;
+} cache_stats_t;
+
+typedef struct {
+    sec_t sector;
+    u32 count;
+    u64 last_used;
+} cache_page_t;
+
+/*
+    A write-through cache of whole pages of sectors, least recently used page evicted first.
+    read and write reach the device underneath; arg is passed back to them.
+*/
+typedef struct {
+    cache_geometry_t geometry;
+    cache_page_t *pages;
+    u8 *data;
+    u64 clock;
+    bool (*read)(void *arg, sec_t sector, sec_t count, void *buffer);
+    bool (*write)(void *arg, sec_t sector, sec_t count, const void *buffer);
+    void *arg;
+    cache_stats_t stats;
+} sector_cache_t;
+
+bool sector_cache_init(sector_cache_t *cache, cache_geometry_t geometry);
+
+void sector_cache_free(sector_cache_t *cache);
+
+bool sector_cache_read(sector_cache_t *cache, sec_t sector, sec_t count, void *buffer);
+
+bool sector_cache_write(sector_cache_t *cache, sec_t sector, sec_t count, const void *buffer);
+
+#endif /* _SECTOR_CACHE_H_ */
@@ -0,0 +1,230 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <malloc.h>
+#include <ogc/cond.h>
+#include <ogc/mutex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/dirent.h>
+
+#include "shared_file.h"
+
+#define SHARED_FILES_MAX 32
+
+typedef struct waiter_struct {
+    u64 offset;
+    struct waiter_struct *next;
+} waiter_t;
+
+/*
+    One open handle on a file, shared by every download of it, e.g. the segments of a segmented download.
+    Downloads take turns at the handle, the next turn going to the waiting download whose offset is the
+    first at or after position, wrapping round to the lowest, so the device is swept in one direction
+    instead of being seeked back and forth.  Everything but f itself is protected by lock.
+    A file that has been written to since it was opened is detached, so that later downloads open it afresh.
+*/
+struct shared_file_struct {
+    FILE *f;
+    char *path;
+    u32 users;
+    bool busy;
+    u64 position;
+    waiter_t *waiting;
+    u32 turns;
+    u32 seeks;
+    mutex_t lock;
+    cond_t changed;
+};
+
+static shared_file_t *files[SHARED_FILES_MAX] = { NULL };
+
+static void free_file(shared_file_t *file) {
+    fclose(file->f);
+    LWP_CondDestroy(file->changed);
+    LWP_MutexDestroy(file->lock);
+    free(file->path);
+    free(file);
+}
+
+static void detach(u32 index) {
+    shared_file_t *file = files[index];
+    files[index] = NULL;
+    free(file->path);
+    file->path = NULL;
+}
+
+/*
+    Takes ownership of f, which should be open for reading and positioned at the download's start.
+    If another download already has path open, f is closed and that handle is shared instead.
+    path is the file's real path, or NULL for a file that can't be shared, such as a generated /ftpii file.
+    Returns NULL and closes f if out of memory.
+*/
+shared_file_t *shared_file_open(FILE *f, const char *path) {
+    u32 i;
+    s32 free_slot = -1;
+    for (i = 0; path && i < SHARED_FILES_MAX; i++) {
+        if (!files[i]) {
+            if (free_slot < 0) free_slot = i;
+        } else if (!strcasecmp(files[i]->path, path)) {
+            fclose(f);
+            files[i]->users++;
+            return files[i];
+        }
+    }
+
+    shared_file_t *file = malloc(sizeof(shared_file_t));
+    if (!file) {
+        fclose(f);
+        return NULL;
+    }
+    memset(file, 0, sizeof(shared_file_t));
+    if (LWP_MutexInit(&file->lock, false) < 0) {
+        fclose(f);
+        free(file);
+        return NULL;
+    }
+    if (LWP_CondInit(&file->changed) < 0) {
+        LWP_MutexDestroy(file->lock);
+        fclose(f);
+        free(file);
+        return NULL;
+    }
+    file->f = f;
+    file->users = 1;
+    off_t position = ftello(f);
+    file->position = position < 0 ? SHARED_FILE_POSITION_UNKNOWN : position;
+    if (path && free_slot >= 0 && (file->path = strdup(path))) files[free_slot] = file;
+    return file;
+}
+
+/*
+    Called once per shared_file_open, after the caller's last shared_file_release.
+*/
+void shared_file_close(shared_file_t *file) {
+    if (--file->users) return;
+    u32 i;
+    for (i = 0; i < SHARED_FILES_MAX; i++) {
+        if (files[i] == file) detach(i);
+    }
+    free_file(file);
+}
+
+static waiter_t *next_waiter(shared_file_t *file) {
+    waiter_t *next = NULL, *lowest = NULL, *waiter;
+    for (waiter = file->waiting; waiter; waiter = waiter->next) {
+        if (waiter->offset >= file->position && (!next || waiter->offset < next->offset)) next = waiter;
+        if (!lowest || waiter->offset < lowest->offset) lowest = waiter;
+    }
+    return next ? next : lowest;
+}
+
+/*
+    Waits for this download's turn at the handle, then returns it positioned at offset,
+    or NULL if the seek failed.  Either way, shared_file_release must be called afterwards.
+*/
+FILE *shared_file_acquire(shared_file_t *file, u64 offset) {
+    waiter_t waiter = { offset, NULL };
+    LWP_MutexLock(file->lock);
+    waiter.next = file->waiting;
+    file->waiting = &waiter;
+    while (file->busy || next_waiter(file) != &waiter) LWP_CondWait(file->changed, file->lock);
+    waiter_t **link;
+    for (link = &file->waiting; *link != &waiter; link = &(*link)->next);
+    *link = waiter.next;
+    file->busy = true;
+    file->turns++;
+    bool seek = file->position != offset;
+    if (seek) file->seeks++;
+    LWP_MutexUnlock(file->lock);
+
+    clearerr(file->f);
+    if (seek && fseeko(file->f, offset, SEEK_SET)) return NULL;
+    return file->f;
+}
+
+/*
+    Ends a turn, leaving the handle at position, or SHARED_FILE_POSITION_UNKNOWN after an error.
+*/
+void shared_file_release(shared_file_t *file, u64 position) {
+    LWP_MutexLock(file->lock);
+    file->position = position;
+    file->busy = false;
+    LWP_CondBroadcast(file->changed);
+    LWP_MutexUnlock(file->lock);
+}
+
+/*
+    Stops later downloads sharing path, or anything below it should it be a directory, once it has been written to.
+*/
+void shared_file_invalidate(const char *path) {
+    u32 length = strlen(path);
+    u32 i;
+    for (i = 0; i < SHARED_FILES_MAX; i++) {
+        if (files[i] && !strncasecmp(files[i]->path, path, length) && (!files[i]->path[length] || files[i]->path[length] == '/')) detach(i);
+    }
+}
+
+/*
+    Stops later downloads sharing any file whose path begins with prefix, e.g. when a device is unmounted.
+*/
+void shared_file_flush(const char *prefix) {
+    u32 length = strlen(prefix);
+    u32 i;
+    for (i = 0; i < SHARED_FILES_MAX; i++) {
+        if (files[i] && !strncasecmp(files[i]->path, prefix, length)) detach(i);
+    }
+}
+
+/*
+    Whether a file whose path begins with prefix is still shared.  Detached files are only held by their downloads.
+*/
+bool shared_files_open_under(const char *prefix) {
+    u32 length = strlen(prefix);
+    u32 i;
+    for (i = 0; i < SHARED_FILES_MAX; i++) {
+        if (files[i] && !strncasecmp(files[i]->path, prefix, length)) return true;
+    }
+    return false;
+}
+
+/*
+    Writes one fact line per open shared file, for /ftpii/files.
+*/
+s32 shared_file_write_state(stats_line_writer write, void *arg) {
+    s32 result = 0;
+    u32 i;
+    for (i = 0; i < SHARED_FILES_MAX && result >= 0; i++) {
+        shared_file_t *file = files[i];
+        if (!file) continue;
+        char line[PATH_MAX + 80];
+        LWP_MutexLock(file->lock);
+        snprintf(line, sizeof(line), "users=%u;position=%lld;turns=%u;seeks=%u;path=%s;",
+            file->users, (s64)file->position, file->turns, file->seeks, file->path);
+        LWP_MutexUnlock(file->lock);
+        result = write(arg, line);
+    }
+    return result;
+}
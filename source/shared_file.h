@@ -0,0 +1,54 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _SHARED_FILE_H_
+#define _SHARED_FILE_H_
+
+#include <gctypes.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+#define SHARED_FILE_POSITION_UNKNOWN (~(u64)0)
+
+typedef struct shared_file_struct shared_file_t;
+
+shared_file_t *shared_file_open(FILE *f, const char *path);
+
+void shared_file_close(shared_file_t *file);
+
+FILE *shared_file_acquire(shared_file_t *file, u64 offset);
+
+void shared_file_release(shared_file_t *file, u64 position);
+
+void shared_file_invalidate(const char *path);
+
+void shared_file_flush(const char *prefix);
+
+bool shared_files_open_under(const char *prefix);
+
+s32 shared_file_write_state(stats_line_writer write, void *arg);
+
+#endif /* _SHARED_FILE_H_ */
@@ -0,0 +1,224 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <ogc/lwp_watchdog.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fs.h"
+#include "stats.h"
+
+#define STATS_LINE_MAX 256
+
+transfer_stats_t download_stats;
+transfer_stats_t upload_stats;
+connection_stats_t connection_stats;
+blockcache_stats_t blockcache_stats;
+
+static const char *bucket_names[LATENCY_BUCKETS] = { "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s" };
+
+void record_latency(latency_stats_t *stats, u64 ticks) {
+    u64 limit = 100;
+    u64 us = ticks_to_microsecs(ticks);
+    u32 bucket;
+    for (bucket = 0; bucket < LATENCY_BUCKETS - 1 && us >= limit; bucket++) limit *= 10;
+    stats->count++;
+    stats->total_ticks += ticks;
+    if (ticks > stats->max_ticks) stats->max_ticks = ticks;
+    stats->buckets[bucket]++;
+}
+
+void record_transfer(transfer_stats_t *stats, bool failed, u64 bytes, u64 ticks, u64 file_ticks, u64 network_ticks, chunk_sizer_t *sizer) {
+    stats->count++;
+    if (failed) stats->failures++;
+    stats->bytes += bytes;
+    stats->ticks += ticks;
+    stats->file_ticks += file_ticks;
+    stats->network_ticks += network_ticks;
+    if (sizer->peak > stats->chunk_peak) stats->chunk_peak = sizer->peak;
+    stats->chunk_fallbacks += sizer->fallbacks;
+    stats->chunk_backoffs += sizer->backoffs;
+    record_latency(&stats->durations, ticks);
+    stats->last_bytes = bytes;
+    stats->last_ticks = ticks;
+    stats->last_file_ticks = file_ticks;
+    stats->last_network_ticks = network_ticks;
+    stats->last_sizer = *sizer;
+}
+
+static u64 kb_per_sec(u64 bytes, u64 ticks) {
+    u64 ms = ticks_to_millisecs(ticks);
+    return ms ? bytes / ms : 0;
+}
+
+/*
+    Human-readable lines are "name: count, avg ..., max ...; bucket count, ...".
+    Machine-readable lines are RFC 3659-style facts, "kind=...;name=...;count=...;total_us=...;max_us=...;buckets=a,b,...;".
+    Returns snprintf's result.
+*/
+s32 format_latency(char *line, size_t size, const char *kind, const char *name, latency_stats_t *stats, bool machine) {
+    u64 total_us = ticks_to_microsecs(stats->total_ticks);
+    u64 max_us = ticks_to_microsecs(stats->max_ticks);
+    s32 length;
+    if (machine) {
+        length = snprintf(line, size, "kind=%s;name=%s;count=%u;total_us=%llu;max_us=%llu;buckets=", kind, name, stats->count, total_us, max_us);
+    } else {
+        length = snprintf(line, size, "%s: %u, avg %llu us, max %llu us;", name, stats->count, stats->count ? total_us / stats->count : 0, max_us);
+    }
+    u32 i;
+    for (i = 0; i < LATENCY_BUCKETS && length >= 0 && length < size; i++) {
+        if (machine) {
+            length += snprintf(line + length, size - length, "%u%s", stats->buckets[i], i < LATENCY_BUCKETS - 1 ? "," : ";");
+        } else {
+            length += snprintf(line + length, size - length, " %s %u%s", bucket_names[i], stats->buckets[i], i < LATENCY_BUCKETS - 1 ? "," : "");
+        }
+    }
+    return length;
+}
+
+static s32 write_transfer_stats(stats_line_writer write, void *arg, bool machine, const char *name, transfer_stats_t *stats) {
+    char line[STATS_LINE_MAX];
+    if (machine) {
+        snprintf(line, sizeof(line), "kind=transfer;name=%s;count=%u;failures=%u;bytes=%llu;total_us=%llu;file_us=%llu;network_us=%llu;"
+            "last_bytes=%llu;last_us=%llu;last_file_us=%llu;last_network_us=%llu;",
+            name, stats->count, stats->failures, stats->bytes, ticks_to_microsecs(stats->ticks),
+            ticks_to_microsecs(stats->file_ticks), ticks_to_microsecs(stats->network_ticks), stats->last_bytes,
+            ticks_to_microsecs(stats->last_ticks), ticks_to_microsecs(stats->last_file_ticks), ticks_to_microsecs(stats->last_network_ticks));
+    } else {
+        snprintf(line, sizeof(line), "%s: %u (%u failed), %llu bytes in %llu ms (%llu KB/s); file I/O %llu ms, network I/O %llu ms",
+            name, stats->count, stats->failures, stats->bytes, ticks_to_millisecs(stats->ticks), kb_per_sec(stats->bytes, stats->ticks),
+            ticks_to_millisecs(stats->file_ticks), ticks_to_millisecs(stats->network_ticks));
+    }
+    s32 result = write(arg, line);
+    if (result >= 0 && !machine && stats->count) {
+        snprintf(line, sizeof(line), "%s last: %llu bytes in %llu ms (%llu KB/s); file I/O %llu ms, network I/O %llu ms",
+            name, stats->last_bytes, ticks_to_millisecs(stats->last_ticks), kb_per_sec(stats->last_bytes, stats->last_ticks),
+            ticks_to_millisecs(stats->last_file_ticks), ticks_to_millisecs(stats->last_network_ticks));
+        result = write(arg, line);
+    }
+    if (result >= 0) {
+        chunk_sizer_t *last = &stats->last_sizer;
+        if (machine) {
+            snprintf(line, sizeof(line), "kind=transfer-chunks;name=%s;peak=%u;fallbacks=%u;backoffs=%u;last_size=%u;last_peak=%u;last_ceiling=%u;last_fallbacks=%u;last_backoffs=%u;",
+                name, stats->chunk_peak, stats->chunk_fallbacks, stats->chunk_backoffs, last->size, last->peak, last->ceiling, last->fallbacks, last->backoffs);
+        } else {
+            s32 length = snprintf(line, sizeof(line), "%s chunks: peak %u bytes, %u fallbacks, %u backoffs",
+                name, stats->chunk_peak, stats->chunk_fallbacks, stats->chunk_backoffs);
+            if (stats->count && length >= 0 && length < sizeof(line)) {
+                snprintf(line + length, sizeof(line) - length, "; last settled at %u bytes (peak %u, ceiling %u) after %u fallbacks and %u backoffs",
+                    last->size, last->peak, last->ceiling, last->fallbacks, last->backoffs);
+            }
+        }
+        result = write(arg, line);
+    }
+    if (result >= 0) {
+        char label[32];
+        snprintf(label, sizeof(label), machine ? "%s" : "%s durations", name);
+        format_latency(line, sizeof(line), "transfer-duration", label, &stats->durations, machine);
+        result = write(arg, line);
+    }
+    return result;
+}
+
+static s32 write_blockcache_stats(stats_line_writer write, void *arg, bool machine) {
+    char line[STATS_LINE_MAX];
+    blockcache_stats_t *stats = &blockcache_stats;
+    if (machine) {
+        snprintf(line, sizeof(line), "kind=blockcache;hits=%llu;misses=%llu;bytes=%llu;insertions=%llu;evictions=%llu;invalidations=%llu;",
+            stats->hits, stats->misses, stats->bytes, stats->insertions, stats->evictions, stats->invalidations);
+    } else {
+        u64 lookups = stats->hits + stats->misses;
+        snprintf(line, sizeof(line), "Block cache: %llu hits, %llu misses (%llu%% hit rate), %llu bytes served from memory, %llu evictions, %llu invalidated",
+            stats->hits, stats->misses, lookups ? stats->hits * 100 / lookups : 0, stats->bytes, stats->evictions, stats->invalidations);
+    }
+    return write(arg, line);
+}
+
+static s32 write_cache_stats(stats_line_writer write, void *arg, bool machine, VIRTUAL_PARTITION *partition) {
+    char line[STATS_LINE_MAX];
+    cache_geometry_t *geometry = &partition->cache.geometry;
+    cache_stats_t *stats = &partition->cache.stats;
+    if (machine) {
+        snprintf(line, sizeof(line), "kind=cache;name=%s;pages=%u;sectors_per_page=%u;requests=%llu;requested_sectors=%llu;hits=%llu;misses=%llu;bypasses=%llu;evictions=%llu;",
+            partition->alias + 1, geometry->pages, geometry->sectors_per_page, stats->requests, stats->requested_sectors,
+            stats->hits, stats->misses, stats->bypasses, stats->evictions);
+    } else {
+        u64 lookups = stats->hits + stats->misses;
+        snprintf(line, sizeof(line), "%s cache: %u x %u sectors, %llu hits, %llu misses (%llu%% hit rate), %llu bypassed, %llu evictions",
+            partition->name, geometry->pages, geometry->sectors_per_page, stats->hits, stats->misses,
+            lookups ? stats->hits * 100 / lookups : 0, stats->bypasses, stats->evictions);
+    }
+    return write(arg, line);
+}
+
+static s32 write_device_stats(stats_line_writer write, void *arg, bool machine, VIRTUAL_PARTITION *partition) {
+    char line[STATS_LINE_MAX];
+    device_stats_t *stats = &partition->stats;
+    if (machine) {
+        snprintf(line, sizeof(line), "kind=device;name=%s;sectors_read=%llu;read_requests=%llu;read_us=%llu;read_errors=%u;sectors_written=%llu;write_requests=%llu;write_us=%llu;write_errors=%u;reserved=%llu;",
+            partition->alias + 1, stats->sectors_read, stats->read_requests, ticks_to_microsecs(stats->read_ticks), stats->read_errors,
+            stats->sectors_written, stats->write_requests, ticks_to_microsecs(stats->write_ticks), stats->write_errors, partition->reserved);
+    } else {
+        snprintf(line, sizeof(line), "%s: read %llu sectors in %llu requests, %llu ms (%u errors), wrote %llu sectors in %llu requests, %llu ms (%u errors), %llu bytes reserved",
+            partition->name, stats->sectors_read, stats->read_requests, ticks_to_millisecs(stats->read_ticks), stats->read_errors,
+            stats->sectors_written, stats->write_requests, ticks_to_millisecs(stats->write_ticks), stats->write_errors, partition->reserved);
+    }
+    s32 result = write(arg, line);
+    if (result >= 0) result = write_cache_stats(write, arg, machine, partition);
+    return result;
+}
+
+/*
+    Writes connection, transfer and device statistics through write, one line at a time.
+*/
+s32 write_stats(stats_line_writer write, void *arg, bool machine) {
+    char line[STATS_LINE_MAX];
+    if (machine) {
+        snprintf(line, sizeof(line), "kind=connections;accepted=%u;rejected=%u;", connection_stats.accepted, connection_stats.rejected);
+    } else {
+        snprintf(line, sizeof(line), "Connections: %u accepted, %u rejected", connection_stats.accepted, connection_stats.rejected);
+    }
+    s32 result = write(arg, line);
+    if (result >= 0) result = write_transfer_stats(write, arg, machine, "Downloads", &download_stats);
+    if (result >= 0) result = write_transfer_stats(write, arg, machine, "Uploads", &upload_stats);
+    if (result >= 0) result = write_blockcache_stats(write, arg, machine);
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS && result >= 0; i++) {
+        result = write_device_stats(write, arg, machine, VIRTUAL_PARTITIONS + i);
+    }
+    return result;
+}
+
+void reset_stats() {
+    memset(&download_stats, 0, sizeof(download_stats));
+    memset(&upload_stats, 0, sizeof(upload_stats));
+    memset(&connection_stats, 0, sizeof(connection_stats));
+    memset(&blockcache_stats, 0, sizeof(blockcache_stats));
+    u32 i;
+    for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
+        memset(&VIRTUAL_PARTITIONS[i].stats, 0, sizeof(device_stats_t));
+        memset(&VIRTUAL_PARTITIONS[i].cache.stats, 0, sizeof(cache_stats_t));
+    }
+}
@@ -0,0 +1,117 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <gctypes.h>
+#include <stddef.h>
+
+#include "net.h"
+
+#define LATENCY_BUCKETS 6
+
+/*
+    Bucket i counts samples under 100us * 10^i, with the last bucket taking everything else.
+*/
+typedef struct {
+    u32 count;
+    u64 total_ticks;
+    u64 max_ticks;
+    u32 buckets[LATENCY_BUCKETS];
+} latency_stats_t;
+
+/*
+    Totals over all transfers in one direction, plus the figures for the most recent one.
+    file_ticks is time spent in file I/O and network_ticks time spent in socket calls.
+    chunk_peak is the largest network chunk any of them sent; last_sizer is where the last one's chunk size ended up.
+*/
+typedef struct {
+    u32 count;
+    u32 failures;
+    u64 bytes;
+    u64 ticks;
+    u64 file_ticks;
+    u64 network_ticks;
+    u32 chunk_peak;
+    u32 chunk_fallbacks;
+    u32 chunk_backoffs;
+    latency_stats_t durations;
+    u64 last_bytes;
+    u64 last_ticks;
+    u64 last_file_ticks;
+    u64 last_network_ticks;
+    chunk_sizer_t last_sizer;
+} transfer_stats_t;
+
+/*
+    Each call to the device is a request, successful or not; fewer, larger requests for the same sectors mean less per-request overhead.
+*/
+typedef struct {
+    u64 sectors_read;
+    u64 sectors_written;
+    u64 read_requests;
+    u64 write_requests;
+    u64 read_ticks;
+    u64 write_ticks;
+    u32 read_errors;
+    u32 write_errors;
+} device_stats_t;
+
+typedef struct {
+    u32 accepted;
+    u32 rejected;
+} connection_stats_t;
+
+/*
+    bytes is what hits served from memory instead of the device.
+*/
+typedef struct {
+    u64 hits;
+    u64 misses;
+    u64 bytes;
+    u64 insertions;
+    u64 evictions;
+    u64 invalidations;
+} blockcache_stats_t;
+
+extern transfer_stats_t download_stats;
+extern transfer_stats_t upload_stats;
+extern connection_stats_t connection_stats;
+extern blockcache_stats_t blockcache_stats;
+
+typedef s32 (*stats_line_writer)(void *arg, const char *line);
+
+void record_latency(latency_stats_t *stats, u64 ticks);
+
+void record_transfer(transfer_stats_t *stats, bool failed, u64 bytes, u64 ticks, u64 file_ticks, u64 network_ticks, chunk_sizer_t *sizer);
+
+s32 format_latency(char *line, size_t size, const char *kind, const char *name, latency_stats_t *stats, bool machine);
+
+s32 write_stats(stats_line_writer write, void *arg, bool machine);
+
+void reset_stats();
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,61 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <ogc/lwp_watchdog.h>
+
+#include "trace.h"
+
+/*
+    The most recent TRACE_MAX_EVENTS events, overwritten oldest first.
+    Any thread may record an event; a slot is claimed by atomically advancing head, so recording never blocks.
+    A snapshot taken while another thread is mid-way through recording may see that one event half-written.
+*/
+static trace_event_t ring[TRACE_MAX_EVENTS];
+static volatile u32 head = 0;
+
+void trace_event(trace_type_t type, u8 session, u32 value, u64 duration_ticks) {
+    u32 position = __sync_fetch_and_add(&head, 1);
+    trace_event_t *event = ring + (position % TRACE_MAX_EVENTS);
+    event->time_us = ticks_to_microsecs(gettime());
+    event->value = value;
+    event->duration_us = ticks_to_microsecs(duration_ticks);
+    event->type = type;
+    event->session = session;
+    event->reserved = 0;
+}
+
+/*
+    Copies up to max_events of the most recent events into events, oldest first, returning how many were copied.
+*/
+u32 trace_snapshot(trace_event_t *events, u32 max_events) {
+    u32 end = head;
+    u32 count = end < TRACE_MAX_EVENTS ? end : TRACE_MAX_EVENTS;
+    if (count > max_events) count = max_events;
+    u32 i;
+    for (i = 0; i < count; i++) {
+        events[i] = ring[(end - count + i) % TRACE_MAX_EVENTS];
+    }
+    return count;
+}
@@ -0,0 +1,72 @@
+/*
+
+ftpii -- an FTP server for the Wii
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <gctypes.h>
+
+#define TRACE_NO_SESSION 0xff
+#define TRACE_MAX_EVENTS 4096 // must be a power of two
+
+typedef enum {
+    TRACE_ACCEPT = 1,       // value: client IPv4 address
+    TRACE_REJECT,           // value: client IPv4 address
+    TRACE_COMMAND_START,    // value: verb, as its first four bytes
+    TRACE_COMMAND_END,      // value: verb, as its first four bytes
+    TRACE_DATA_CONNECT,
+    TRACE_DATA_CLOSE,       // value: 0 on success, else the negated error
+    TRACE_FILE_READ,        // value: bytes
+    TRACE_FILE_WRITE,       // value: bytes
+    TRACE_NET_SEND,         // value: bytes, or the negated error
+    TRACE_NET_RECV          // value: bytes, or the negated error
+} trace_type_t;
+
+/*
+    The binary format of /ftpii/trace: a trace_header_t, then count trace_event_ts, oldest first, in the server's byte order (big-endian on the console).
+    time_us is the time the event was recorded (i.e. when it ended), in microseconds since boot, truncated to 32 bits.
+    session is the client's session slot, or TRACE_NO_SESSION.
+*/
+typedef struct {
+    char magic[4]; // "FTRC"
+    u32 version;
+    u32 event_size;
+    u32 count;
+} trace_header_t;
+
+typedef struct {
+    u32 time_us;
+    u32 value;
+    u32 duration_us;
+    u8 type;
+    u8 session;
+    u16 reserved;
+} trace_event_t;
+
+void trace_event(trace_type_t type, u8 session, u32 value, u64 duration_ticks);
+
+u32 trace_snapshot(trace_event_t *events, u32 max_events);
+
+#endif /* _TRACE_H_ */
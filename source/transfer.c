@@ -0,0 +1,636 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <ogc/cond.h>
+#include <ogc/lwp.h>
+#include <ogc/lwp_watchdog.h>
+#include <ogc/mutex.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blockcache.h"
+#include "dircache.h"
+#include "journal.h"
+#include "log.h"
+#include "shared_file.h"
+#include "stats.h"
+#include "trace.h"
+#include "transfer.h"
+#include "vrt.h"
+
+#define TRANSFER_BUFFERS 4
+#define TRANSFER_BUFFER_SIZE BLOCKCACHE_BLOCK_SIZE // downloads read whole cache blocks
+#define TRANSFER_THREAD_STACK_SIZE 16384
+#define TRANSFER_THREAD_PRIORITY 64 // same as the main thread
+#define JOURNAL_COMMIT_INTERVAL (4 * 1024 * 1024)
+#define UPLOAD_RUN_SIZE (256 * 1024) // per upload with an announced size, on top of its transfer buffers
+
+/*
+    A ring of TRANSFER_BUFFERS buffers between a file thread and the network side.
+    count is the number of filled buffers, waiting at head to be consumed.
+    Downloads: the file thread fills buffers[tail], the network side drains buffers[head] from offset.
+    Uploads: the network side fills buffers[tail] up to offset, the file thread drains buffers[head].
+    Everything except the buffer contents themselves is protected by lock.
+    Downloads read through shared, positioned at position when their file thread next reads;
+    a download of a file that can be cached and shared has its real path.
+    Uploads write at position, having begun at start, and an upload with a real path keeps its journal at committed
+    and holds reserved bytes of its partition's free space until it finishes.  Unless an ALLO announced a large upload,
+    the journal is only created at the first commit, so that small uploads never touch the directory for it.
+    The network side fills buffers[tail] up to limit, which is short only for the first buffer of a resumed or appended upload,
+    so that from there on every cluster boundary falls between two whole buffers.
+    They are written through fd where the stream has one, so that nothing is copied into stdio's buffer on the way.
+    An upload with a run_buffer gathers buffers there and writes them out at each multiple of run_size,
+    a multiple of the cluster size, so that each write ends on a cluster boundary;
+    run_length is only changed by the file thread while it holds a buffer from the ring, or under lock.
+    network_waiting is set while the network side has nothing to do until the file thread moves on.
+*/
+struct transfer_struct {
+    FILE *f;
+    char path[PATH_MAX]; // "" if there is none
+    u8 session;
+    shared_file_t *shared;
+    u64 position;
+    u64 start;
+    u64 committed;
+    bool journalled;
+    u64 reserved;
+    int fd;
+    u8 *run_buffer;
+    u32 run_size;
+    u32 run_length;
+    u8 *buffers[TRANSFER_BUFFERS];
+    u32 lengths[TRANSFER_BUFFERS];
+    u32 head;
+    u32 tail;
+    u32 count;
+    u32 offset;
+    u32 limit;
+    bool eof;
+    s32 error;
+    bool stop;
+    mutex_t lock;
+    cond_t changed;
+    lwp_t thread;
+    bool joined;
+    chunk_sizer_t sizer;
+    u64 bytes;
+    u64 start_time;
+    u64 file_ticks;
+    u64 file_wait_ticks;
+    u64 network_ticks;
+    u64 network_wait_ticks;
+    u64 network_wait_start;
+    bool network_waiting;
+    transfer_t *next;
+};
+
+/*
+    Every transfer from allocation until it is freed, so that a device isn't remounted under their threads.
+    Only used from the main thread.
+*/
+static transfer_t *live_transfers = NULL;
+
+static void free_transfer(transfer_t *transfer) {
+    transfer_t **link;
+    for (link = &live_transfers; *link; link = &(*link)->next) {
+        if (*link == transfer) {
+            *link = transfer->next;
+            break;
+        }
+    }
+    u32 i;
+    for (i = 0; i < TRANSFER_BUFFERS; i++) free(transfer->buffers[i]);
+    free(transfer->run_buffer);
+    free(transfer);
+}
+
+static transfer_t *allocate_transfer(FILE *f, u8 session) {
+    transfer_t *transfer = malloc(sizeof(transfer_t));
+    if (!transfer) return NULL;
+    memset(transfer, 0, sizeof(transfer_t));
+    transfer->next = live_transfers;
+    live_transfers = transfer;
+    u32 i;
+    for (i = 0; i < TRANSFER_BUFFERS; i++) {
+        if (!(transfer->buffers[i] = memalign(32, TRANSFER_BUFFER_SIZE))) {
+            free_transfer(transfer);
+            return NULL;
+        }
+    }
+    transfer->f = f;
+    transfer->session = session;
+    chunk_sizer_init(&transfer->sizer);
+    transfer->start_time = gettime();
+    return transfer;
+}
+
+static bool start_thread(transfer_t *transfer, void *(*entry)(void *)) {
+    if (LWP_MutexInit(&transfer->lock, false) < 0) return false;
+    if (LWP_CondInit(&transfer->changed) < 0) {
+        LWP_MutexDestroy(transfer->lock);
+        return false;
+    }
+    if (LWP_CreateThread(&transfer->thread, entry, transfer, NULL, TRANSFER_THREAD_STACK_SIZE, TRANSFER_THREAD_PRIORITY) < 0) {
+        LWP_CondDestroy(transfer->changed);
+        LWP_MutexDestroy(transfer->lock);
+        return false;
+    }
+    return true;
+}
+
+/*
+    Tells the file thread to stop, failing the transfer with error unless it is 0, and waits for it to exit.
+*/
+static void join_thread(transfer_t *transfer, s32 error) {
+    if (transfer->joined) return;
+    LWP_MutexLock(transfer->lock);
+    transfer->stop = true;
+    if (error && !transfer->error) transfer->error = error;
+    LWP_CondSignal(transfer->changed);
+    LWP_MutexUnlock(transfer->lock);
+    LWP_JoinThread(transfer->thread, NULL);
+    transfer->joined = true;
+}
+
+static void stop_thread(transfer_t *transfer) {
+    join_thread(transfer, 0);
+    LWP_CondDestroy(transfer->changed);
+    LWP_MutexDestroy(transfer->lock);
+}
+
+/*
+    Wakes the main thread if the network side is waiting on the file thread.  Must be called with lock held.
+*/
+static void wake_network_side(transfer_t *transfer) {
+    if (!transfer->network_waiting) return;
+    transfer->network_waiting = false;
+    wake_main_thread();
+}
+
+static void record_transfer_stats(transfer_t *transfer, transfer_stats_t *stats, bool failed, const char *direction) {
+    u64 ticks = diff_ticks(transfer->start_time, gettime());
+    record_transfer(stats, failed, transfer->bytes, ticks, transfer->file_ticks, transfer->network_ticks, &transfer->sizer);
+    u64 ms = ticks_to_millisecs(ticks);
+    log_info(LOG_TRANSFER, "%s %llu bytes in %llu ms (%llu KB/s); file I/O %llu ms, network I/O %llu ms, file waited %llu ms for network, network waited %llu ms for file.",
+        direction, transfer->bytes, ms, ms ? transfer->bytes / ms : 0, ticks_to_millisecs(transfer->file_ticks), ticks_to_millisecs(transfer->network_ticks),
+        ticks_to_millisecs(transfer->file_wait_ticks), ticks_to_millisecs(transfer->network_wait_ticks));
+    log_chunk_sizer(LOG_TRANSFER, "Network", &transfer->sizer);
+}
+
+/*
+    Fills up to free_buffers buffers from tail with consecutive blocks, from the block cache where it has them.
+    The first block it doesn't have waits for a turn at the shared handle, which is kept for the rest of the run
+    so that the device reads the run in one go.
+*/
+static void read_run(transfer_t *transfer, u32 free_buffers) {
+    bool turn = false;
+    FILE *f = NULL;
+    u64 file_position = SHARED_FILE_POSITION_UNKNOWN;
+    bool done = false;
+    while (free_buffers-- && !done) {
+        u32 index = transfer->tail;
+        u64 read_start = gettime();
+        size_t length = TRANSFER_BUFFER_SIZE - transfer->position % TRANSFER_BUFFER_SIZE;
+        s32 bytes_read = BLOCKCACHE_MISS;
+        bool failed = false;
+        if (*transfer->path && length == TRANSFER_BUFFER_SIZE) bytes_read = blockcache_read(transfer->path, transfer->position, transfer->buffers[index]);
+        if (bytes_read == BLOCKCACHE_MISS) {
+            u32 generation = blockcache_generation();
+            if (!turn) {
+                turn = true;
+                f = shared_file_acquire(transfer->shared, transfer->position);
+                file_position = transfer->position;
+            } else if (f && file_position != transfer->position && fseeko(f, transfer->position, SEEK_SET)) {
+                f = NULL;
+            }
+            bytes_read = f ? fread(transfer->buffers[index], 1, length, f) : 0;
+            failed = !f || (bytes_read < length && ferror(f));
+            file_position = failed ? SHARED_FILE_POSITION_UNKNOWN : transfer->position + bytes_read;
+            if (*transfer->path && length == TRANSFER_BUFFER_SIZE && !failed) {
+                blockcache_insert(transfer->path, transfer->position, transfer->buffers[index], bytes_read, generation);
+            }
+        }
+        transfer->position += bytes_read;
+        u64 read_ticks = diff_ticks(read_start, gettime());
+        trace_event(TRACE_FILE_READ, transfer->session, bytes_read, read_ticks);
+
+        LWP_MutexLock(transfer->lock);
+        transfer->file_ticks += read_ticks;
+        if (bytes_read > 0) {
+            transfer->lengths[index] = bytes_read;
+            transfer->tail = (index + 1) % TRANSFER_BUFFERS;
+            transfer->count++;
+        }
+        if (failed) transfer->error = -EIO;
+        else if (bytes_read < length) transfer->eof = true;
+        done = transfer->stop || transfer->eof || transfer->error;
+        wake_network_side(transfer);
+        LWP_MutexUnlock(transfer->lock);
+    }
+    if (turn) shared_file_release(transfer->shared, file_position);
+}
+
+/*
+    Keeps the ring full of file data ahead of send_download.
+*/
+static void *download_thread(void *arg) {
+    transfer_t *transfer = arg;
+    LWP_MutexLock(transfer->lock);
+    while (!transfer->stop && !transfer->eof && !transfer->error) {
+        if (transfer->count == TRANSFER_BUFFERS) {
+            u64 wait_start = gettime();
+            LWP_CondWait(transfer->changed, transfer->lock);
+            transfer->file_wait_ticks += diff_ticks(wait_start, gettime());
+            continue;
+        }
+        u32 free_buffers = TRANSFER_BUFFERS - transfer->count;
+        LWP_MutexUnlock(transfer->lock);
+        read_run(transfer, free_buffers);
+        LWP_MutexLock(transfer->lock);
+    }
+    wake_network_side(transfer);
+    LWP_MutexUnlock(transfer->lock);
+    return NULL;
+}
+
+/*
+    Takes ownership of f, even on failure, which should already be positioned at the restart offset.
+    path is the real path of the file if it may be shared with other downloads of it
+    and its blocks served from and added to the block cache (or NULL).
+    session identifies the client in the trace.
+    Returns NULL and sets errno if the pipeline could not be started.
+*/
+transfer_t *start_download(FILE *f, const char *path, u8 session) {
+    off_t position = ftello(f);
+    transfer_t *transfer = allocate_transfer(NULL, session);
+    if (transfer) {
+        if (path) strcpy(transfer->path, path);
+        transfer->position = MAX(position, 0);
+        transfer->shared = shared_file_open(f, position < 0 ? NULL : path);
+    } else {
+        fclose(f);
+    }
+    if (!transfer || !transfer->shared || !start_thread(transfer, download_thread)) {
+        if (transfer) {
+            if (transfer->shared) shared_file_close(transfer->shared);
+            free_transfer(transfer);
+        }
+        errno = ENOMEM;
+        return NULL;
+    }
+    return transfer;
+}
+
+/*
+    Data connection callback: sends whatever the file thread has read so far.
+    Returns -EAGAIN when the socket is full, and -EBUSY when the ring is empty,
+    in which case the socket is not the thing to wait for: the file thread calls wake_main_thread once it has read more.
+*/
+s32 send_download(s32 s, output_queue_t *output, transfer_t *transfer) {
+    s32 result = -EAGAIN;
+    LWP_MutexLock(transfer->lock);
+    while (1) {
+        if (!transfer->count) {
+            if (transfer->error || transfer->eof) {
+                result = transfer->error;
+            } else {
+                if (!transfer->network_wait_start) transfer->network_wait_start = gettime();
+                transfer->network_waiting = true;
+                result = -EBUSY;
+            }
+            break;
+        }
+        if (transfer->network_wait_start) {
+            transfer->network_wait_ticks += diff_ticks(transfer->network_wait_start, gettime());
+            transfer->network_wait_start = 0;
+        }
+
+        u32 index = transfer->head;
+        char *buf = (char *)transfer->buffers[index] + transfer->offset;
+        s32 length = transfer->lengths[index] - transfer->offset;
+        LWP_MutexUnlock(transfer->lock);
+        u64 send_start = gettime();
+        s32 bytes_written = send_nonblocking(s, &transfer->sizer, buf, length);
+        u64 send_ticks = diff_ticks(send_start, gettime());
+        transfer->network_ticks += send_ticks;
+        trace_event(TRACE_NET_SEND, transfer->session, bytes_written, send_ticks);
+        LWP_MutexLock(transfer->lock);
+
+        if (bytes_written < 0) {
+            result = bytes_written;
+            break;
+        }
+        transfer->bytes += bytes_written;
+        if (bytes_written < length) {
+            transfer->offset += bytes_written;
+            break;
+        }
+        transfer->offset = 0;
+        transfer->head = (index + 1) % TRANSFER_BUFFERS;
+        transfer->count--;
+        LWP_CondSignal(transfer->changed);
+    }
+    LWP_MutexUnlock(transfer->lock);
+    return result;
+}
+
+void finish_download(transfer_t *transfer) {
+    stop_thread(transfer);
+    shared_file_close(transfer->shared);
+    record_transfer_stats(transfer, &download_stats, transfer->error || !transfer->eof || transfer->count, "Sent");
+    free_transfer(transfer);
+}
+
+/*
+    Makes sure everything written so far is on the card, then records it in the journal.
+*/
+static void commit_upload(transfer_t *transfer) {
+    if (fflush(transfer->f)) return;
+    int fd = fileno(transfer->f);
+    if (fd >= 0 && fsync(fd)) return;
+    bool recorded = transfer->journalled ? journal_update(transfer->path, transfer->position) : journal_create(transfer->path, transfer->position);
+    if (recorded) {
+        transfer->committed = transfer->position;
+        transfer->journalled = true;
+    }
+}
+
+/*
+    Writes length bytes at the upload's position.
+*/
+static bool write_out(transfer_t *transfer, const u8 *data, u32 length) {
+    if (transfer->fd < 0) {
+        if (fwrite(data, 1, length, transfer->f) < length) return false;
+    } else {
+        u32 written = 0;
+        while (written < length) {
+            ssize_t result = write(transfer->fd, data + written, length - written);
+            if (result <= 0) return false;
+            written += result;
+        }
+    }
+    transfer->position += length;
+    return true;
+}
+
+/*
+    Writes out a buffer taken from the ring, or gathers it into the run, which goes out when it reaches a multiple
+    of run_size in the file.  What is left of the run at the end goes out from upload_thread.
+*/
+static bool write_upload_buffer(transfer_t *transfer, const u8 *data, u32 length) {
+    if (!transfer->run_buffer) return write_out(transfer, data, length);
+    memcpy(transfer->run_buffer + transfer->run_length, data, length);
+    transfer->run_length += length;
+    if ((transfer->position + transfer->run_length) % transfer->run_size) return true;
+    bool written = write_out(transfer, transfer->run_buffer, transfer->run_length);
+    transfer->run_length = 0;
+    return written;
+}
+
+/*
+    Writes out everything the network side has received, until told to stop and both the ring and the run are empty.
+*/
+static void *upload_thread(void *arg) {
+    transfer_t *transfer = arg;
+    LWP_MutexLock(transfer->lock);
+    while (!transfer->error) {
+        if (!transfer->count) {
+            if (transfer->run_length && (transfer->stop || transfer->eof)) {
+                LWP_MutexUnlock(transfer->lock);
+                u64 write_start = gettime();
+                bool failed = !write_out(transfer, transfer->run_buffer, transfer->run_length);
+                u64 write_ticks = diff_ticks(write_start, gettime());
+                trace_event(TRACE_FILE_WRITE, transfer->session, transfer->run_length, write_ticks);
+                LWP_MutexLock(transfer->lock);
+                transfer->file_ticks += write_ticks;
+                transfer->run_length = 0;
+                if (failed) transfer->error = -EIO;
+                wake_network_side(transfer);
+                continue;
+            }
+            if (transfer->stop || transfer->eof) break;
+            u64 wait_start = gettime();
+            LWP_CondWait(transfer->changed, transfer->lock);
+            transfer->file_wait_ticks += diff_ticks(wait_start, gettime());
+            continue;
+        }
+        u32 index = transfer->head;
+        u32 length = transfer->lengths[index];
+        LWP_MutexUnlock(transfer->lock);
+
+        u64 write_start = gettime();
+        bool failed = !write_upload_buffer(transfer, transfer->buffers[index], length);
+        if (!failed && *transfer->path && transfer->position - transfer->committed >= JOURNAL_COMMIT_INTERVAL) commit_upload(transfer);
+        u64 write_ticks = diff_ticks(write_start, gettime());
+        trace_event(TRACE_FILE_WRITE, transfer->session, length, write_ticks);
+
+        LWP_MutexLock(transfer->lock);
+        transfer->file_ticks += write_ticks;
+        if (failed) {
+            transfer->error = -EIO;
+        } else {
+            transfer->head = (index + 1) % TRANSFER_BUFFERS;
+            transfer->count--;
+        }
+        wake_network_side(transfer);
+    }
+    wake_network_side(transfer);
+    LWP_MutexUnlock(transfer->lock);
+    return NULL;
+}
+
+/*
+    Hands the partially-filled buffer at tail to the file thread.  Must be called with lock held.
+*/
+static void commit_upload_buffer(transfer_t *transfer) {
+    if (!transfer->offset) return;
+    transfer->lengths[transfer->tail] = transfer->offset;
+    transfer->tail = (transfer->tail + 1) % TRANSFER_BUFFERS;
+    transfer->count++;
+    transfer->offset = 0;
+    transfer->limit = TRANSFER_BUFFER_SIZE;
+    LWP_CondSignal(transfer->changed);
+}
+
+/*
+    Gives an upload whose size was announced with ALLO a run buffer of up to UPLOAD_RUN_SIZE, so that the card
+    sees the rest of the file as a few long writes, for each of which the filesystem allocates the run of clusters
+    in one go instead of extending the file a transfer buffer at a time.  Where clusters are bigger than a transfer
+    buffer, every upload gets a run of at least a cluster, so that no write covers part of one.  Best effort.
+*/
+static void buffer_upload_runs(transfer_t *transfer, u32 cluster, u64 remaining) {
+    u32 unit = MAX(cluster, TRANSFER_BUFFER_SIZE);
+    u32 size = MAX(MIN(remaining, MAX(UPLOAD_RUN_SIZE, unit)) / unit * unit, unit);
+    if (size <= TRANSFER_BUFFER_SIZE) return;
+    if ((transfer->run_buffer = memalign(32, size))) transfer->run_size = size;
+}
+
+/*
+    Takes ownership of f, which should already be positioned where writing is to begin,
+    path is the real path of the file (or NULL), whose cached metadata is dropped once the upload finishes
+    and which is journalled until then, from the start if at least JOURNAL_COMMIT_INTERVAL is reserved.
+    reserved bytes already set aside with reserve_space are released when it finishes.
+    Returns NULL and sets errno if the pipeline could not be started.
+*/
+transfer_t *start_upload(FILE *f, const char *path, u8 session, u64 reserved) {
+    transfer_t *transfer = allocate_transfer(f, session);
+    if (transfer) {
+        off_t position = ftello(f);
+        if (path) strcpy(transfer->path, path);
+        transfer->position = transfer->start = transfer->committed = MAX(position, 0);
+        transfer->reserved = reserved;
+        transfer->fd = fileno(f);
+        if (transfer->fd < 0) setvbuf(f, NULL, _IONBF, 0); // nothing has been written yet; stdio would split each write around its buffer
+        u32 cluster = cluster_size(path), unit = MAX(cluster, TRANSFER_BUFFER_SIZE);
+        u32 short_length = (unit - transfer->position % unit) % unit % TRANSFER_BUFFER_SIZE;
+        transfer->limit = short_length ? short_length : TRANSFER_BUFFER_SIZE;
+        buffer_upload_runs(transfer, cluster, reserved);
+        if (path && position < 0) {
+            log_warning(LOG_TRANSFER, "Unable to journal the upload to %s; it can only be resumed from its size on the card.", path);
+            transfer->journalled = true; // with no idea where it starts, never create one
+        }
+    } else {
+        release_space(path, reserved);
+    }
+    if (!transfer || !start_thread(transfer, upload_thread)) {
+        if (transfer) {
+            release_space(path, reserved);
+            free_transfer(transfer);
+        }
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (path && !transfer->journalled && reserved >= JOURNAL_COMMIT_INTERVAL) { // nothing reaches the thread before this returns
+        transfer->journalled = journal_begin(path, transfer->position);
+        if (!transfer->journalled) log_warning(LOG_TRANSFER, "Unable to journal the upload to %s; it will be from its first commit.", path);
+    }
+    return transfer;
+}
+
+/*
+    Data connection callback: receives one chunk into the ring and returns -EAGAIN.
+    Returns -EBUSY while the ring is full, or once the client has finished sending
+    until the file thread has written everything out, as the socket has nothing to say in either case;
+    the file thread calls wake_main_thread once it has written a buffer out.
+*/
+s32 receive_upload(s32 s, output_queue_t *output, transfer_t *transfer) {
+    s32 result;
+    LWP_MutexLock(transfer->lock);
+    if (transfer->error) {
+        result = transfer->error;
+    } else if (transfer->eof) {
+        result = transfer->count || transfer->run_length ? -EBUSY : 0;
+    } else if (transfer->count == TRANSFER_BUFFERS) {
+        if (!transfer->network_wait_start) transfer->network_wait_start = gettime();
+        result = -EBUSY;
+    } else {
+        if (transfer->network_wait_start) {
+            transfer->network_wait_ticks += diff_ticks(transfer->network_wait_start, gettime());
+            transfer->network_wait_start = 0;
+        }
+        char *buf = (char *)transfer->buffers[transfer->tail] + transfer->offset;
+        s32 length = transfer->limit - transfer->offset;
+        LWP_MutexUnlock(transfer->lock);
+        u64 recv_start = gettime();
+        s32 bytes_read = recv_nonblocking(s, &transfer->sizer, buf, length);
+        u64 recv_ticks = diff_ticks(recv_start, gettime());
+        transfer->network_ticks += recv_ticks;
+        trace_event(TRACE_NET_RECV, transfer->session, bytes_read, recv_ticks);
+        LWP_MutexLock(transfer->lock);
+
+        if (bytes_read > 0) {
+            transfer->bytes += bytes_read;
+            transfer->offset += bytes_read;
+            if (transfer->offset == transfer->limit) commit_upload_buffer(transfer);
+            result = -EAGAIN;
+        } else if (bytes_read == 0) {
+            commit_upload_buffer(transfer);
+            transfer->eof = true;
+            LWP_CondSignal(transfer->changed);
+            result = transfer->count || transfer->run_length ? -EBUSY : 0;
+        } else {
+            result = bytes_read;
+        }
+    }
+    if (result == -EBUSY) transfer->network_waiting = true;
+    LWP_MutexUnlock(transfer->lock);
+    return result;
+}
+
+/*
+    Anything already received is still written out, even if the transfer was aborted.
+*/
+void finish_upload(transfer_t *transfer) {
+    LWP_MutexLock(transfer->lock);
+    commit_upload_buffer(transfer);
+    LWP_MutexUnlock(transfer->lock);
+    stop_thread(transfer);
+    bool closed = !fclose(transfer->f);
+    bool failed = transfer->error || !transfer->eof;
+    if (*transfer->path) {
+        if (!failed) journal_end(transfer->path);
+        else if (closed) journal_update(transfer->path, transfer->position);
+        dircache_invalidate(transfer->path);
+        blockcache_invalidate(transfer->path);
+        shared_file_invalidate(transfer->path);
+        commit_space(transfer->path, transfer->reserved, transfer->start, transfer->position);
+    }
+    record_transfer_stats(transfer, &upload_stats, failed, "Received");
+    free_transfer(transfer);
+}
+
+/*
+    Fails every transfer of a file whose real path begins with prefix, e.g. when its device is removed,
+    and waits for their file threads to leave the filesystem.  Their data connections then close with an error.
+*/
+void abort_transfers_under(const char *prefix) {
+    u32 length = strlen(prefix);
+    transfer_t *transfer;
+    for (transfer = live_transfers; transfer; transfer = transfer->next) {
+        if (*transfer->path && !strncasecmp(transfer->path, prefix, length)) {
+            LWP_MutexLock(transfer->lock);
+            transfer->error = -ENODEV;
+            LWP_CondSignal(transfer->changed);
+            LWP_MutexUnlock(transfer->lock);
+        }
+    }
+    for (transfer = live_transfers; transfer; transfer = transfer->next) {
+        if (*transfer->path && !strncasecmp(transfer->path, prefix, length)) join_thread(transfer, -ENODEV);
+    }
+}
+
+/*
+    Whether a transfer of a file whose real path begins with prefix is still open.
+*/
+bool transfers_open_under(const char *prefix) {
+    u32 length = strlen(prefix);
+    transfer_t *transfer;
+    for (transfer = live_transfers; transfer; transfer = transfer->next) {
+        if (*transfer->path && !strncasecmp(transfer->path, prefix, length)) return true;
+    }
+    return false;
+}
@@ -0,0 +1,49 @@
+/*
+
+Copyright (C) 2008 Joseph Jordan <joe.ftpii@psychlaw.com.au>
+
+This software is provided 'as-is', without any express or implied warranty.
+In no event will the authors be held liable for any damages arising from
+the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1.The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software in a
+product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+
+2.Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+
+3.This notice may not be removed or altered from any source distribution.
+
+*/
+#ifndef _TRANSFER_H_
+#define _TRANSFER_H_
+
+#include <stdio.h>
+
+#include "net.h"
+
+typedef struct transfer_struct transfer_t;
+
+transfer_t *start_download(FILE *f, const char *path, u8 session);
+
+s32 send_download(s32 s, output_queue_t *output, transfer_t *transfer);
+
+void finish_download(transfer_t *transfer);
+
+transfer_t *start_upload(FILE *f, const char *path, u8 session, u64 reserved);
+
+s32 receive_upload(s32 s, output_queue_t *output, transfer_t *transfer);
+
+void finish_upload(transfer_t *transfer);
+
+void abort_transfers_under(const char *prefix);
+
+bool transfers_open_under(const char *prefix);
+
+#endif /* _TRANSFER_H_ */
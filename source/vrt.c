@@ -24,297 +24,427 @@ misrepresented as being the original software.
 */
 #include <errno.h>
 #include <malloc.h>
-#include <stdarg.h>
 #include <string.h>
 #include <sys/dirent.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 #include <gctypes.h>
 
+#include "blockcache.h"
 #include "fs.h"
+#include "journal.h"
+#include "procfs.h"
+#include "shared_file.h"
 #include "vrt.h"
 
-static char *virtual_abspath(char *virtual_cwd, char *virtual_path) {
-	char *path;
-	if (virtual_path[0] == '/') {
-		path = virtual_path;
-	} else {
-		size_t path_size = strlen(virtual_cwd) + strlen(virtual_path) + 1;
-		if (path_size > PATH_MAX || !(path = malloc(path_size))) return NULL;
-		strcpy(path, virtual_cwd);
-		strcat(path, virtual_path);
-	}
-
-	char *normalised_path = malloc(strlen(path) + 1);
-	if (!normalised_path) goto end;
-	*normalised_path = '\0';
-	char *curr_dir = normalised_path;
-
-	u32 state = 0; // 0:start, 1:slash, 2:dot, 3:dotdot
-	char *token = path;
-	while (1) {
-		switch (state) {
-		case 0:
-			if (*token == '/') {
-				state = 1;
-				curr_dir = normalised_path + strlen(normalised_path);
-				strncat(normalised_path, token, 1);
-			}
-			break;
-		case 1:
-			if (*token == '.') state = 2;
-			else if (*token != '/') state = 0;
-			break;
-		case 2:
-			if (*token == '/' || !*token) {
-				state = 1;
-				*(curr_dir + 1) = '\0';
-			} else if (*token == '.') state = 3;
-			else state = 0;
-			break;
-		case 3:
-			if (*token == '/' || !*token) {
-				state = 1;
-				*curr_dir = '\0';
-				char *prev_dir = strrchr(normalised_path, '/');
-				if (prev_dir) curr_dir = prev_dir;
-				else *curr_dir = '/';
-				*(curr_dir + 1) = '\0';
-			} else state = 0;
-			break;
+/*
+	Appends the components of path to the normalised absolute path in out (of length *len, without a trailing slash),
+	resolving "." and ".." as it goes.  Returns false if the result would not fit in PATH_MAX.
+*/
+static bool append_components(char *out, size_t *len, const char *path) {
+	while (*path) {
+		while (*path == '/') path++;
+		const char *component = path;
+		while (*path && *path != '/') path++;
+		size_t component_len = path - component;
+
+		if (!component_len || (component_len == 1 && component[0] == '.')) {
+			continue;
+		} else if (component_len == 2 && component[0] == '.' && component[1] == '.') {
+			while (*len && out[--*len] != '/');
+		} else {
+			if (*len + 1 + component_len >= PATH_MAX) return false;
+			out[(*len)++] = '/';
+			memcpy(out + *len, component, component_len);
+			*len += component_len;
 		}
-		if (!*token) break;
-		if (state == 0 || *token != '/') strncat(normalised_path, token, 1);
-		token++;
 	}
+	return true;
+}
 
-	u32 end = strlen(normalised_path);
-	while (end > 1 && normalised_path[end - 1] == '/') {
-		normalised_path[--end] = '\x00';
+/*
+	Maps a normalised absolute path beneath alias onto the real path beneath prefix.
+	Returns 0 on success, 1 if path is not beneath alias, or -1 with errno set if the result is too long.
+*/
+static int map_alias(const char *path, const char *alias, const char *prefix, char *real_path) {
+	size_t alias_len = strlen(alias);
+	if (strncasecmp(alias, path, alias_len) || (path[alias_len] && path[alias_len] != '/')) return 1;
+	const char *rest = path + alias_len;
+	if (*rest == '/') rest++;
+	size_t prefix_len = strlen(prefix);
+	if (prefix_len + strlen(rest) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
 	}
-
-	end:
-	if (path != virtual_path) free(path);
-	return normalised_path;
+	strcpy(real_path, prefix);
+	strcpy(real_path + prefix_len, rest);
+	return 0;
 }
 
 /*
-	Converts a client-visible path to a real absolute path
-	E.g. "/sd/foo"	-> "sd:/foo"
-		 "/sd"		-> "sd:/"
-		 "/sd/../usb" -> "usb:/"
-	The resulting path will fit in an array of size PATH_MAX
-	Returns NULL to indicate that the client-visible path is invalid
+	Resolves a client-visible path against virtual_cwd, in a single pass and without allocating.
+	E.g. "/sd/foo"	-> "/sd/foo", "sd:/foo"
+		 "/sd"		-> "/sd", "sd:/"
+		 "/sd/../usb" -> "/usb", "usb:/"
+		 "/"		-> "/", "" (the vfs-root)
+	Returns 0 on success, or -1 with errno set if the client-visible path is invalid.
 */
-char *to_real_path(char *virtual_cwd, char *virtual_path) {
-	errno = ENOENT;
+int vrt_resolve(const char *virtual_cwd, const char *virtual_path, vrt_path_t *resolved) {
 	if (strchr(virtual_path, ':')) {
-		return NULL; // colon is not allowed in virtual path, i've decided =P
+		errno = ENOENT;
+		return -1; // colon is not allowed in virtual path, i've decided =P
 	}
 
-	virtual_path = virtual_abspath(virtual_cwd, virtual_path);
-	if (!virtual_path) return NULL;
-
-	char *path = NULL;
-	char *rest = virtual_path;
+	char *path = resolved->virtual_path;
+	size_t len = 0;
+	if ((virtual_path[0] != '/' && !append_components(path, &len, virtual_cwd)) || !append_components(path, &len, virtual_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (!len) path[len++] = '/';
+	path[len] = '\0';
 
-	if (!strcmp("/", virtual_path)) {
+	if (len == 1) {
 		// indicate vfs-root with ""
-		path = "";
-		goto end;
+		*resolved->real_path = '\0';
+		return 0;
 	}
 
-	const char *prefix = NULL;
 	u32 i;
 	for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
 		VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + i;
-		const char *alias = partition->alias;
-		size_t alias_len = strlen(alias);
-		if (!strcasecmp(alias, virtual_path) || (!strncasecmp(alias, virtual_path, alias_len) && virtual_path[alias_len] == '/')) {
-			prefix = partition->prefix;
-			rest += alias_len;
-			if (*rest == '/') rest++;
-			break;
-		}
+		int result = map_alias(path, partition->alias, partition->prefix, resolved->real_path);
+		if (result <= 0) return result;
 	}
-	if (!prefix) {
-		errno = ENODEV;
-		goto end;
+	int result = map_alias(path, PROCFS_ALIAS, PROCFS_PREFIX, resolved->real_path);
+	if (result <= 0) return result;
+
+	errno = ENODEV;
+	return -1;
+}
+
+/*
+	Resolves to a real path on a device, failing for the vfs-root which has no real path
+	and for the read-only /ftpii tree.
+*/
+static int resolve_device_path(const char *cwd, const char *path, vrt_path_t *resolved) {
+	if (vrt_resolve(cwd, path, resolved)) return -1;
+	if (!*resolved->real_path) {
+		errno = EPERM;
+		return -1;
+	} else if (procfs_path(resolved->real_path)) {
+		errno = EROFS;
+		return -1;
 	}
+	return 0;
+}
 
-	size_t real_path_size = strlen(prefix) + strlen(rest) + 1;
-	if (real_path_size > PATH_MAX) goto end;
+static VIRTUAL_PARTITION *partition_of(const char *real_path) {
+	u32 i;
+	for (i = 0; i < MAX_VIRTUAL_PARTITIONS; i++) {
+		VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + i;
+		if (!strncasecmp(real_path, partition->prefix, strlen(partition->prefix))) return partition;
+	}
+	return NULL;
+}
 
-	path = malloc(real_path_size);
-	if (!path) goto end;
-	strcpy(path, prefix);
-	strcat(path, rest);
+/*
+	Looks up real_path's cluster size and free space once per mount, as libfat's statvfs may scan the whole FAT.
+	With refresh, looks the free space up again even if it is known.  Only used from the main thread.
+*/
+static bool look_up_space(VIRTUAL_PARTITION *partition, const char *real_path, bool refresh) {
+	if (partition->cluster_size && !refresh) return true;
+	struct statvfs st;
+	if (statvfs(real_path, &st) || !st.f_bsize) return false;
+	partition->cluster_size = st.f_bsize;
+	partition->free_space = (u64)st.f_bavail * st.f_frsize;
+	return true;
+}
 
-	end:
-	free(virtual_path);
-	return path;
+static u64 round_to_clusters(VIRTUAL_PARTITION *partition, u64 bytes) {
+	return (bytes + partition->cluster_size - 1) / partition->cluster_size * partition->cluster_size;
 }
 
-typedef void * (*path_func)(char *path, ...);
-
-static void *with_virtual_path(void *virtual_cwd, void *void_f, char *virtual_path, s32 failed, ...) {
-	char *path = to_real_path(virtual_cwd, virtual_path);
-	if (!path || !*path) return (void *)failed;
-
-	path_func f = (path_func)void_f;
-	va_list ap;
-	void *args[3];
-	unsigned int num_args = 0;
-	va_start(ap, failed);
-	do {
-		void *arg = va_arg(ap, void *);
-		if (!arg) break;
-		args[num_args++] = arg;
-	} while (1);
-	va_end(ap);
-
-	void *result;
-	switch (num_args) {
-		case 0: result = f(path); break;
-		case 1: result = f(path, args[0]); break;
-		case 2: result = f(path, args[0], args[1]); break;
-		case 3: result = f(path, args[0], args[1], args[2]); break;
-		default: result = (void *)failed; break;
+/*
+	Sets aside bytes of the free space on real_path's partition for an upload, so that uploads which
+	could not all fit fail when they start instead of when the card fills.  Only used from the main thread.
+	The free space is the cached figure; only when that looks too small is the card asked again.
+	Returns false with errno set if the free space, less what other uploads hold, is too small.
+*/
+bool reserve_space(const char *real_path, u64 bytes) {
+	VIRTUAL_PARTITION *partition = partition_of(real_path);
+	if (!partition || !bytes) return true;
+	if (!look_up_space(partition, real_path, false)) return false;
+	if (partition->free_space < partition->reserved || partition->free_space - partition->reserved < bytes) {
+		if (!look_up_space(partition, real_path, true)) return false;
+		if (partition->free_space < partition->reserved || partition->free_space - partition->reserved < bytes) {
+			errno = ENOSPC;
+			return false;
+		}
 	}
+	partition->reserved += bytes;
+	return true;
+}
 
-	free(path);
-	return result;
+/*
+	The cluster size of real_path's partition, looked up once per mount.
+	A sector if real_path is on no partition or the size can't be found.
+*/
+u32 cluster_size(const char *real_path) {
+	VIRTUAL_PARTITION *partition = real_path ? partition_of(real_path) : NULL;
+	if (!partition || !look_up_space(partition, real_path, false)) return SECTOR_SIZE;
+	return partition->cluster_size;
+}
+
+void release_space(const char *real_path, u64 bytes) {
+	VIRTUAL_PARTITION *partition = real_path ? partition_of(real_path) : NULL;
+	if (partition) partition->reserved -= MIN(bytes, partition->reserved);
 }
 
-FILE *vrt_fopen(char *cwd, char *path, char *mode) {
-	return with_virtual_path(cwd, fopen, path, 0, mode, NULL);
+/*
+	An upload that began writing at from has finished at to: releases its reservation of reserved bytes,
+	and takes the clusters the file grew by off the partition's cached free space.
+*/
+void commit_space(const char *real_path, u64 reserved, u64 from, u64 to) {
+	release_space(real_path, reserved);
+	VIRTUAL_PARTITION *partition = real_path ? partition_of(real_path) : NULL;
+	if (!partition || !partition->cluster_size || to <= from) return;
+	u64 grown = round_to_clusters(partition, to) - round_to_clusters(partition, from);
+	partition->free_space -= MIN(grown, partition->free_space);
+}
+
+FILE *vrt_fopen(const char *cwd, char *path, char *mode) {
+	vrt_path_t resolved;
+	if (vrt_resolve(cwd, path, &resolved) == 0 && procfs_path(resolved.real_path) && *mode == 'r' && !strchr(mode, '+')) {
+		return procfs_fopen(resolved.real_path);
+	}
+	if (resolve_device_path(cwd, path, &resolved)) return NULL;
+	if (*mode != 'r' || strchr(mode, '+')) {
+		dircache_invalidate(resolved.real_path);
+		blockcache_invalidate(resolved.real_path);
+		shared_file_invalidate(resolved.real_path);
+	}
+	return fopen(resolved.real_path, mode);
 }
 
-int vrt_stat(char *cwd, char *path, struct stat *st) {
-	char *real_path = to_real_path(cwd, path);
-	if (!real_path) return -1;
-	else if (!*real_path) {
+static int stat_resolved(vrt_path_t *resolved, struct stat *st) {
+	if (!*resolved->real_path) {
+		memset(st, 0, sizeof(struct stat));
 		st->st_mode = S_IFDIR;
 		st->st_size = 31337;
 		return 0;
 	}
-	free(real_path);
-	return (int)with_virtual_path(cwd, stat, path, -1, st, NULL);
+	if (procfs_path(resolved->real_path)) return procfs_stat(resolved->real_path, st);
+	return dircache_stat(resolved->real_path, st) ? 0 : stat(resolved->real_path, st);
 }
 
-int vrt_chdir(char *cwd, char *path) {
+int vrt_stat(const char *cwd, char *path, struct stat *st) {
+	vrt_path_t resolved;
+	if (vrt_resolve(cwd, path, &resolved)) return -1;
+	return stat_resolved(&resolved, st);
+}
 
+int vrt_chdir(char *cwd, char *path) {
+	vrt_path_t resolved;
 	struct stat st;
-	if (vrt_stat(cwd, path, &st)) {
+	if (vrt_resolve(cwd, path, &resolved) || stat_resolved(&resolved, &st)) {
 		return -1;
 	} else if (!(st.st_mode & S_IFDIR)) {
 		errno = ENOTDIR;
 		return -1;
 	}
-	char *abspath = virtual_abspath(cwd, path);
-	if (!abspath) {
-		errno = ENOMEM;
-		return -1;
-	}
-	strcpy(cwd, abspath);
+	strcpy(cwd, resolved.virtual_path);
 	if (cwd[1]) strcat(cwd, "/");
-	free(abspath);
 	return 0;
 }
 
-int vrt_unlink(char *cwd, char *path) {
-	return (int)with_virtual_path(cwd, unlink, path, -1, NULL);
+int vrt_unlink(const char *cwd, char *path) {
+	vrt_path_t resolved;
+	if (resolve_device_path(cwd, path, &resolved)) return -1;
+	VIRTUAL_PARTITION *partition = partition_of(resolved.real_path);
+	struct stat st;
+	bool freed = partition && partition->cluster_size && !stat_resolved(&resolved, &st);
+	int result = unlink(resolved.real_path);
+	if (!result && freed) partition->free_space += round_to_clusters(partition, st.st_size);
+	dircache_invalidate(resolved.real_path);
+	blockcache_invalidate(resolved.real_path);
+	shared_file_invalidate(resolved.real_path);
+	if (!result) journal_end(resolved.real_path);
+	return result;
 }
 
-int vrt_mkdir(char *cwd, char *path, mode_t mode) {
-	return (int)with_virtual_path(cwd, mkdir, path, -1, mode, NULL);
+int vrt_mkdir(const char *cwd, char *path, mode_t mode) {
+	vrt_path_t resolved;
+	if (resolve_device_path(cwd, path, &resolved)) return -1;
+	int result = mkdir(resolved.real_path, mode);
+	dircache_invalidate(resolved.real_path);
+	return result;
 }
 
-int vrt_rename(char *cwd, char *from_path, char *to_path) {
-	char *real_to_path = to_real_path(cwd, to_path);
-	if (!real_to_path || !*real_to_path) return -1;
-	int result = (int)with_virtual_path(cwd, rename, from_path, -1, real_to_path, NULL);
-	free(real_to_path);
+int vrt_rename(const char *cwd, const char *from_path, char *to_path) {
+	vrt_path_t from, to;
+	if (resolve_device_path(cwd, to_path, &to) || resolve_device_path(cwd, from_path, &from)) return -1;
+	int result = rename(from.real_path, to.real_path);
+	dircache_invalidate(from.real_path);
+	dircache_invalidate(to.real_path);
+	blockcache_invalidate(from.real_path);
+	blockcache_invalidate(to.real_path);
+	shared_file_invalidate(from.real_path);
+	shared_file_invalidate(to.real_path);
+	if (!result) journal_rename(from.real_path, to.real_path);
 	return result;
 }
 
 /*
-	When in vfs-root this creates a fake DIR_ITER.
+	When in vfs-root or /ftpii this creates a fake DIR_ITER.
+	Otherwise the directory is read from the cache if possible,
+	and if not, recorded into the cache as it is read from the device.
  */
-DIR_P *vrt_opendir(char *cwd, char *path)
+DIR_P *vrt_opendir(const char *cwd, char *path)
 {
-	char *real_path = to_real_path(cwd, path);
-	if (!real_path) return NULL;
+	vrt_path_t resolved;
+	if (vrt_resolve(cwd, path, &resolved)) return NULL;
 
 	DIR_P *iter = malloc(sizeof(DIR_P));
-	if (!iter)
-	{
-		if (*real_path != 0)
-			free(real_path);
-		return NULL;
-	}
+	if (!iter) return NULL;
 
+	iter->dir = NULL;
 	iter->virt_root = 0;
-	iter->path = real_path;
+	strcpy(iter->path, resolved.real_path);
+	iter->position = 0;
+	iter->current = NULL;
+	iter->cache = NULL;
+	iter->from_cache = false;
+	iter->complete = false;
+	iter->procfs = false;
 
 	if (*iter->path == 0) {
-		iter->dir = malloc(sizeof(DIR));
-		if(!iter->dir) {
-			// root path is not allocated
+		iter->virt_root = 1; // we are at the virtual root
+		return iter;
+	}
+
+	if (procfs_path(iter->path)) {
+		struct stat st;
+		int result = procfs_stat(iter->path, &st);
+		if (result || !S_ISDIR(st.st_mode)) {
+			if (!result) errno = ENOTDIR;
 			free(iter);
 			return NULL;
 		}
-		memset(iter->dir, 0, sizeof(DIR));
-		iter->virt_root = 1; // we are at the virtual root
+		iter->procfs = true;
+		return iter;
+	}
+
+	if ((iter->cache = dircache_open(iter->path))) {
+		iter->from_cache = true;
 		return iter;
 	}
 
-	iter->dir = with_virtual_path(cwd, opendir, path, 0, NULL);
+	iter->dir = opendir(iter->path);
 	if(!iter->dir)
 	{
-		free(iter->path);
 		free(iter);
 		return NULL;
 	}
+	iter->cache = dircache_begin(iter->path);
 
 	return iter;
 }
 
-/*
-	Yields virtual aliases when pDir->virt_root
- */
-struct dirent *vrt_readdir(DIR_P *pDir) {
-	if(!pDir || !pDir->dir) return NULL;
+static struct dirent *next_entry(DIR_P *pDir) {
 
-	DIR *iter = pDir->dir;
+	pDir->current = NULL;
 	if (pDir->virt_root) {
-		for (; (u32)iter->position < MAX_VIRTUAL_PARTITIONS; iter->position++) {
-			VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + (int)iter->position;
+		for (; pDir->position < MAX_VIRTUAL_PARTITIONS; pDir->position++) {
+			VIRTUAL_PARTITION *partition = VIRTUAL_PARTITIONS + pDir->position;
 			if (partition->inserted) {
-				iter->fileData.d_type = DT_DIR;
-				strcpy(iter->fileData.d_name, partition->alias + 1);
-				iter->position++;
-				return &iter->fileData;
+				pDir->entry.d_type = DT_DIR;
+				strcpy(pDir->entry.d_name, partition->alias + 1);
+				pDir->position++;
+				return &pDir->entry;
 			}
 		}
+		if (pDir->position == MAX_VIRTUAL_PARTITIONS) {
+			pDir->entry.d_type = DT_DIR;
+			strcpy(pDir->entry.d_name, PROCFS_ALIAS + 1);
+			pDir->position++;
+			return &pDir->entry;
+		}
+		return NULL;
+	}
+
+	if (pDir->procfs) {
+		const char *name = procfs_entry(pDir->position);
+		if (!name) return NULL;
+		pDir->entry.d_type = DT_REG;
+		strcpy(pDir->entry.d_name, name);
+		pDir->position++;
+		return pDir->current = &pDir->entry;
+	}
+
+	if (pDir->from_cache) {
+		if (!dircache_entry(pDir->cache, pDir->position, &pDir->entry)) return NULL;
+		pDir->position++;
+		return pDir->current = &pDir->entry;
+	}
+
+	if (!pDir->dir || !(pDir->current = readdir(pDir->dir))) {
+		pDir->complete = true;
 		return NULL;
 	}
-	return readdir(iter);
+	if (pDir->cache && !dircache_add(pDir->cache, pDir->current)) {
+		dircache_close(pDir->cache, false);
+		pDir->cache = NULL;
+	}
+	pDir->position++;
+	return pDir->current;
+}
+
+/*
+	Yields virtual aliases, then /ftpii, when pDir->virt_root, and the generated files when pDir->procfs.
+	Upload journals are left out.
+ */
+struct dirent *vrt_readdir(DIR_P *pDir) {
+	if(!pDir) return NULL;
+	struct dirent *entry;
+	while ((entry = next_entry(pDir)) && journal_file(entry->d_name));
+	return entry;
+}
+
+/*
+	Stats the entry most recently returned by vrt_readdir, via the cache where possible.
+ */
+int vrt_stat_entry(DIR_P *iter, struct stat *st) {
+	if (!iter->current) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (iter->cache && dircache_entry_stat(iter->cache, iter->position - 1, st)) return 0;
+
+	char path[PATH_MAX];
+	size_t path_len = strlen(iter->path);
+	bool separator = path_len && iter->path[path_len - 1] != '/';
+	if (path_len + separator + strlen(iter->current->d_name) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(path, iter->path);
+	if (separator) strcat(path, "/");
+	strcat(path, iter->current->d_name);
+	if (iter->procfs) return procfs_stat(path, st);
+	if (stat(path, st)) return -1;
+	if (iter->cache) dircache_set_entry_stat(iter->cache, iter->position - 1, st);
+	return 0;
 }
 
 int vrt_closedir(DIR_P *iter) {
 	if(!iter) return -1;
 
 	if(iter->dir)
-	{
-		if (iter->virt_root)
-			free(iter->dir);
-		else
-			closedir(iter->dir);
-	}
+		closedir(iter->dir);
 
-	// root path is not allocated
-	if(iter->path && *iter->path != 0)
-		free(iter->path);
+	if(iter->cache)
+		dircache_close(iter->cache, iter->complete);
 
 	free(iter);
 
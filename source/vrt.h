@@ -29,26 +29,52 @@ misrepresented as being the original software.
 extern "C"{
 #endif
 
+#include <limits.h>
 #include <stdio.h>
 #include <sys/dirent.h>
 
+#include "dircache.h"
+
 typedef struct
 {
 	DIR *dir;
-	char *path;
+	char path[PATH_MAX];
 	u8 virt_root;
+	u32 position;
+	struct dirent entry;
+	struct dirent *current;
+	cached_dir_t *cache;
+	bool from_cache;
+	bool complete;
+	bool procfs;
 } DIR_P;
 
-char *to_real_path(char *virtual_cwd, char *virtual_path);
+/*
+	A client-visible path resolved once, so that it can be shared between operations without reallocating.
+	virtual_path is normalised and absolute, real_path is "" for the vfs-root.
+*/
+typedef struct
+{
+	char virtual_path[PATH_MAX];
+	char real_path[PATH_MAX];
+} vrt_path_t;
+
+int vrt_resolve(const char *virtual_cwd, const char *virtual_path, vrt_path_t *resolved);
+
+bool reserve_space(const char *real_path, u64 bytes);
+void release_space(const char *real_path, u64 bytes);
+void commit_space(const char *real_path, u64 reserved, u64 from, u64 to);
+u32 cluster_size(const char *real_path);
 
-FILE *vrt_fopen(char *cwd, char *path, char *mode);
-int vrt_stat(char *cwd, char *path, struct stat *st);
+FILE *vrt_fopen(const char *cwd, char *path, char *mode);
+int vrt_stat(const char *cwd, char *path, struct stat *st);
 int vrt_chdir(char *cwd, char *path);
-int vrt_unlink(char *cwd, char *path);
-int vrt_mkdir(char *cwd, char *path, mode_t mode);
-int vrt_rename(char *cwd, char *from_path, char *to_path);
-DIR_P *vrt_opendir(char *cwd, char *path);
+int vrt_unlink(const char *cwd, char *path);
+int vrt_mkdir(const char *cwd, char *path, mode_t mode);
+int vrt_rename(const char *cwd, const char *from_path, char *to_path);
+DIR_P *vrt_opendir(const char *cwd, char *path);
 struct dirent *vrt_readdir(DIR_P *iter);
+int vrt_stat_entry(DIR_P *iter, struct stat *st);
 int vrt_closedir(DIR_P *iter);
 
 #ifdef __cplusplus